@@ -2,11 +2,13 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct mlfqinfo;
 struct pipe;
 struct proc;
 struct rtcdate;
 struct spinlock;
 struct sleeplock;
+struct spawnfd;
 struct stat;
 struct superblock;
 // define exist structure or sth
@@ -26,6 +28,8 @@ void            panic(char*) __attribute__((noreturn));
 // exec.c
 int             exec(char*, char**);
 int				exec2(char*, char**, int);
+int             loadimage(char*, char**, int, pde_t**, uint*, uint*, uint*);
+char*           progname(char*);
 
 // file.c
 struct file*    filealloc(void);
@@ -59,6 +63,19 @@ int				useradd(char *username, char *password);
 int				userdel(char *username);
 void			retusername(char *username);
 
+// futex.c
+void            futexinit(void);
+int             futex_wait(uint, int);
+int             futex_wake(uint, int);
+
+// memcg.c
+void            memcginit(void);
+int             memcgcur(void);
+int             memcgcharge(int);
+void            memcguncharge(int);
+void            memcgjoin(int, int);
+int             memcgswitch(int, int);
+
 // ide.c
 void            ideinit(void);
 void            ideintr(void);
@@ -74,6 +91,10 @@ char*           kalloc(void);
 void            kfree(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+int             kfreepages(void);
+void            kref(char*);
+int             kcharge(char*, int);
+int             krefcount(char*);
 
 // kbd.c
 void            kbdintr(void);
@@ -84,6 +105,7 @@ int             lapicid(void);
 extern volatile uint*    lapic;
 void            lapiceoi(void);
 void            lapicinit(void);
+void            lapicipi(int, int);
 void            lapicstartap(uchar, uint);
 void            microdelay(int);
 
@@ -113,6 +135,11 @@ int             cpuid(void);
 void            exit(void);
 int             fork(void);
 int             growproc(int);
+int             spawn(char*, char**, int, struct spawnfd*);
+int             clone(uint, uint, uint, int);
+int             stopthreads(void);
+void            thread_exit(void*);
+int             thread_join(int, void**);
 int             kill(int);
 struct cpu*     mycpu(void);
 struct proc*    myproc();
@@ -122,20 +149,31 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
+int             sleeptimeout(void*, struct spinlock*, uint);
+void            timertick(uint);
 void            userinit(void);
 int             wait(void);
 void            wakeup(void*);
+void            wakeproc(struct proc*, void*);
 void            yield(void);
+void            chargetime(void);
 int				getlev(void);
 int				setpriority(int,int);
 void			yield_MLFQ(int);
 void			yield_MLFQ_last_Level(int);
 void			priority_boosting(void);
-void			priority_boosting_nolock(void);
+void			renormalize(struct proc*);
+int				mlfqctl(struct mlfqinfo*, struct mlfqinfo*);
+extern struct mlfqinfo mlfq;
 int				getadmin(char *password);
 char*			getshmem(int);
 void			list_process(void);
 int				setmemorylimit(int pid,int limit);
+int				setaffinity(int, int);
+int				setrealtime(int, int);
+int				rtpreempt(void);
+void			rtreplenish(void);
+int				getpstat(uint, int);
 
 // swtch.S
 void            swtch(struct context**, struct context*);
@@ -178,10 +216,9 @@ void            timerinit(void);
 // trap.c
 void            idtinit(void);
 extern uint     ticks;
+extern uint     tsc_per_tick;
 void            tvinit(void);
 extern struct 	spinlock tickslock;
-extern enum     queueLevel queue_L;
-extern const int time_limit;
 //extern int 		level_tick[5];
 
 // uart.c
@@ -196,13 +233,21 @@ pde_t*          setupkvm(void);
 char*           uva2ka(pde_t*, char*);
 int             allocuvm(pde_t*, uint, uint);
 int             deallocuvm(pde_t*, uint, uint);
+int             shrinkuvm(pde_t*, uint, uint);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
 pde_t*          copyuvm(pde_t*, uint);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
+void            tlbcheck(void);
+void            tlbshootdown(pde_t*);
 int             copyout(pde_t*, uint, void*, uint);
+int             cowfault(pde_t*, uint);
+void            zeroinit(void);
+int             lazyfault(pde_t*, uint, uint, int);
+int             uvmprepare(pde_t*, uint, uint, uint, int);
+uint            uvaphys(pde_t*, uint, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
 //prac_syscall.c
 int				myfunction(char*);
@@ -2,22 +2,27 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
 #include "x86.h"
 #include "elf.h"
+#include "spawn.h"
 
+// Build a fresh user address space for the ELF at path:
+// program segments, an inaccessible guard page, stackpages
+// pages of stack, and argv pushed onto it.  Nothing about the
+// calling process is touched, so both exec and spawn use it.
 int
-exec(char *path, char **argv)
+loadimage(char *path, char **argv, int stackpages,
+          pde_t **pgdirp, uint *szp, uint *spp, uint *entryp)
 {
-  char *s, *last;
   int i, off;
   uint argc, sz, sp, ustack[3+MAXARG+1];
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
-  pde_t *pgdir, *oldpgdir;
-  struct proc *curproc = myproc();
+  pde_t *pgdir;
 
   begin_op();
 
@@ -60,12 +65,17 @@ exec(char *path, char **argv)
   end_op();
   ip = 0;
 
-  // Allocate two pages at the next page boundary.
-  // Make the first inaccessible.  Use the second as the user stack.
+  // Reserve stackpages+1 pages at the next page boundary.
+  // Make the first an inaccessible guard page.  Only the top
+  // stack page is mapped now; lazyfault() maps the rest as the
+  // stack grows down into them.
   sz = PGROUNDUP(sz);
-  if((sz = allocuvm(pgdir, sz, sz + 2*PGSIZE)) == 0)
+  if((sz = allocuvm(pgdir, sz, sz + PGSIZE)) == 0)
+    goto bad;
+  clearpteu(pgdir, (char*)(sz - PGSIZE));
+  sz += stackpages*PGSIZE;
+  if(allocuvm(pgdir, sz - PGSIZE, sz) == 0)
     goto bad;
-  clearpteu(pgdir, (char*)(sz - 2*PGSIZE));
   sp = sz;
 
   // Push argument strings, prepare rest of stack in ustack.
@@ -87,25 +97,10 @@ exec(char *path, char **argv)
   if(copyout(pgdir, sp, ustack, (3+argc+1)*4) < 0)
     goto bad;
 
-  // Save program name for debugging.
-  for(last=s=path; *s; s++)
-    if(*s == '/')
-      last = s+1;
-  safestrcpy(curproc->name, last, sizeof(curproc->name));
-
-  // Commit to the user image.
-  oldpgdir = curproc->pgdir;
-  curproc->pgdir = pgdir;
-  curproc->sz = sz;
-  curproc->tf->eip = elf.entry;  // main
-  curproc->tf->esp = sp;
-
-  curproc-> stack_count = 1;
-  curproc-> mode = 0;
-  curproc-> limit = 0;
-
-  switchuvm(curproc);
-  freevm(oldpgdir);
+  *pgdirp = pgdir;
+  *szp = sz;
+  *spp = sp;
+  *entryp = elf.entry;
   return 0;
 
  bad:
@@ -115,126 +110,98 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
-return -1;
+  return -1;
 }
 
-int
-exec2(char *path, char **argv, int stacksize)
+// Last path component, for p->name.
+char*
+progname(char *path)
 {
   char *s, *last;
-  int i, off;
-  uint argc, sz, sp, ustack[3+MAXARG+1];
-  struct elfhdr elf;
-  struct inode *ip;
-  struct proghdr ph;
+
+  for(last=s=path; *s; s++)
+    if(*s == '/')
+      last = s+1;
+  return last;
+}
+
+static int
+commit(char *path, char **argv, int stacksize)
+{
+  uint sz, sp, entry;
   pde_t *pgdir, *oldpgdir;
   struct proc *curproc = myproc();
 
-  begin_op();
-
-  if((ip = namei(path)) == 0){
-    end_op();
-    cprintf("exec: fail\n");
+  if(loadimage(path, argv, stacksize, &pgdir, &sz, &sp, &entry) < 0)
+    return -1;
+  // The old image goes away under any other threads.
+  if(stopthreads() < 0){
+    freevm(pgdir);
     return -1;
   }
-  ilock(ip);
-  pgdir = 0;
-
-  // Check ELF header
-  if(readi(ip, (char*)&elf, 0, sizeof(elf)) != sizeof(elf))
-    goto bad;
-  if(elf.magic != ELF_MAGIC)
-    goto bad;
-
-  if((pgdir = setupkvm()) == 0)
-    goto bad;
-
-  // Load program into memory.
-  sz = 0;
-  for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
-    if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
-      goto bad;
-    if(ph.type != ELF_PROG_LOAD)
-      continue;
-    if(ph.memsz < ph.filesz)
-      goto bad;
-    if(ph.vaddr + ph.memsz < ph.vaddr)
-      goto bad;
-    if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
-      goto bad;
-    if(ph.vaddr % PGSIZE != 0)
-      goto bad;
-    if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
-      goto bad;
-  }
-  iunlockput(ip);
-  end_op();
-  ip = 0;
-
-  // Allocate two pages at the next page boundary.
-  // Make the first inaccessible.  Use the second as the user stack.
-  sz = PGROUNDUP(sz);
-  if((sz = allocuvm(pgdir, sz, sz + (stacksize + 1)*PGSIZE)) == 0)
-    goto bad;
-  clearpteu(pgdir, (char*)(sz - (stacksize + 1)*PGSIZE));
-  sp = sz;
-
-  // Push argument strings, prepare rest of stack in ustack.
-  for(argc = 0; argv[argc]; argc++) {
-    if(argc >= MAXARG)
-      goto bad;
-    sp = (sp - (strlen(argv[argc]) + 1)) & ~3;
-    if(copyout(pgdir, sp, argv[argc], strlen(argv[argc]) + 1) < 0)
-      goto bad;
-    ustack[3+argc] = sp;
-  }
-  ustack[3+argc] = 0;
-
-  ustack[0] = 0xffffffff;  // fake return PC
-  ustack[1] = argc;
-  ustack[2] = sp - (argc+1)*4;  // argv pointer
-
-  sp -= (3+argc+1) * 4;
-  if(copyout(pgdir, sp, ustack, (3+argc+1)*4) < 0)
-    goto bad;
 
   // Save program name for debugging.
-  for(last=s=path; *s; s++)
-    if(*s == '/')
-      last = s+1;
-  safestrcpy(curproc->name, last, sizeof(curproc->name));
+  safestrcpy(curproc->name, progname(path), sizeof(curproc->name));
 
   // Commit to the user image.
   oldpgdir = curproc->pgdir;
   curproc->pgdir = pgdir;
   curproc->sz = sz;
-  curproc->tf->eip = elf.entry;  // main
+  curproc->tf->eip = entry;  // main
   curproc->tf->esp = sp;
-  
-  curproc-> stack_count = stacksize;
+
+  curproc-> stack_count = 1;
+  curproc-> stackbase = sz - stacksize*PGSIZE;
+  curproc-> stacktop = sz;
+  curproc-> nfreestack = 0;
   curproc-> mode = 0;
-  curproc -> limit = 0;
+  curproc-> limit = 0;
 
   switchuvm(curproc);
   freevm(oldpgdir);
   return 0;
+}
 
- bad:
-  if(pgdir)
-    freevm(pgdir);
-  if(ip){
-    iunlockput(ip);
-    end_op();
+int
+exec(char *path, char **argv)
+{
+  return commit(path, argv, 1);
+}
+
+int
+exec2(char *path, char **argv, int stacksize)
+{
+  return commit(path, argv, stacksize);
+}
+
+// Copy a user argv array at uargv into argv.
+static int
+fetchargv(uint uargv, char **argv)
+{
+  int i;
+  uint uarg;
+
+  memset(argv, 0, MAXARG*sizeof(argv[0]));
+  for(i=0;;i++){
+    if(i >= MAXARG)
+      return -1;
+    if(fetchint(uargv+4*i, (int*)&uarg) < 0)
+      return -1;
+    if(uarg == 0){
+      argv[i] = 0;
+      return 0;
+    }
+    if(fetchstr(uarg, &argv[i]) < 0)
+      return -1;
   }
-  return -1;
 }
 
 int
 sys_exec2(void){
 	char *path, *argv[MAXARG];
-	int stacksize, i;
+	int stacksize;
 	struct proc *p = myproc();
-	uint uargv, uarg;
+	uint uargv;
 	
 	if(!p)
 		return -1;
@@ -246,18 +213,40 @@ sys_exec2(void){
 		return -1;
 
 
-	memset(argv, 0,sizeof(argv));
-	for(i=0;;i++){
-		if(i >= NELEM(argv))
-			return -1;
-		if(fetchint(uargv+4*i, (int*)&uarg) < 0)
-			return -1;
-		if(uarg == 0){
-			argv[i] = 0;
-			break;
-		}
-		if(fetchstr(uarg, &argv[i]) < 0)
-			return -1;
-	}
+	if(fetchargv(uargv, argv) < 0)
+		return -1;
 	return exec2(path, argv, stacksize);
 }
+
+int
+sys_spawn(void){
+	char *path, *argv[MAXARG];
+	int stacksize, nact;
+	uint uargv;
+	struct spawnfd *act, acts[NOFILE+1];
+
+	if(argstr(0, &path) < 0 || argint(1, (int*)&uargv) < 0 || argint(2,&stacksize) < 0)
+		return -1;
+	if(argptr(3, (char**)&act, 0) < 0)
+		return -1;
+	if(fetchargv(uargv, argv) < 0)
+		return -1;
+
+	// Copy the action list into the kernel so spawn() can walk
+	// it without checking user pointers again.
+	nact = 0;
+	if(act){
+		for(;;){
+			if(nact >= NELEM(acts))
+				return -1;
+			if(fetchint((uint)&act[nact].op, &acts[nact].op) < 0 ||
+			   fetchint((uint)&act[nact].fd, &acts[nact].fd) < 0 ||
+			   fetchint((uint)&act[nact].newfd, &acts[nact].newfd) < 0)
+				return -1;
+			if(acts[nact++].op == SPAWN_END)
+				break;
+		}
+	} else
+		acts[0].op = SPAWN_END;
+	return spawn(path, argv, stacksize, acts);
+}
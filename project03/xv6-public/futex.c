@@ -0,0 +1,179 @@
+// Futexes: block on a word of user memory until another
+// process or thread changes it and calls futex_wake().
+//
+// A word in private memory is keyed by its process's page
+// table and its virtual address, which copy-on-write and
+// lazy faults do not change; a word in a getshmem() page,
+// mapped at its kernel address, by its physical address, so
+// that every process sharing the page meets on the same key.
+// Each key hashes to a queue with its own lock; a wake only
+// touches the waiters there.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "proc.h"
+
+#define NFUTEXHASH 64  // wait queues; a power of two
+
+struct futexq {
+  struct spinlock lock;
+  struct proc *head;   // waiters, linked through fnext
+};
+
+static struct futexq futexq[NFUTEXHASH];
+
+void
+futexinit(void)
+{
+  int i;
+
+  for(i = 0; i < NFUTEXHASH; i++)
+    initlock(&futexq[i].lock, "futex");
+}
+
+static struct futexq*
+futexhash(pde_t *space, uint key)
+{
+  return &futexq[((key ^ (uint)space) >> 2) & (NFUTEXHASH-1)];
+}
+
+// The key for the word at addr in p: (p->pgdir, addr) for
+// private memory, (0, physical address) for a getshmem()
+// page.  Returns -1 for a bad address.
+static int
+futexkey(struct proc *p, uint addr, pde_t **space, uint *key)
+{
+  uint pa;
+
+  if(addr % 4 != 0)
+    return -1;
+  if(addr < KERNBASE){
+    if(addr >= p->sz)
+      return -1;
+    *space = p->pgdir;
+    *key = addr;
+    return 0;
+  }
+  if((pa = uvaphys(p->pgdir, addr, p->sz)) == 0)
+    return -1;
+  *space = 0;
+  *key = pa;
+  return 0;
+}
+
+static void
+futexunlink(struct futexq *q, struct proc *p)
+{
+  struct proc **pp;
+
+  for(pp = &q->head; *pp; pp = &(*pp)->fnext){
+    if(*pp == p){
+      *pp = p->fnext;
+      break;
+    }
+  }
+  p->fnext = 0;
+  p->futexspace = 0;
+  p->futexkey = 0;
+}
+
+// If the word at addr still holds val, sleep until a
+// futex_wake() on it.  Returns 0 once woken, 1 if the word
+// had changed, -1 for a bad address or if killed.
+int
+futex_wait(uint addr, int val)
+{
+  struct proc *p = myproc();
+  struct futexq *q;
+  pde_t *space;
+  uint key, pa;
+  int r;
+
+  if(futexkey(p, addr, &space, &key) < 0)
+    return -1;
+  // Fault the word in now: q->lock is a spinlock.
+  if((pa = uvaphys(p->pgdir, addr, p->sz)) == 0)
+    return -1;
+  q = futexhash(space, key);
+
+  // The compare and the enqueue happen under q->lock, which
+  // futex_wake() also takes, so a wake cannot slip between.
+  acquire(&q->lock);
+  if(p->killed){
+    release(&q->lock);
+    return -1;
+  }
+  if(*(int*)P2V(pa) != val){
+    release(&q->lock);
+    return 1;
+  }
+  p->futexspace = space;
+  p->futexkey = key;
+  p->fnext = q->head;
+  q->head = p;
+  sleep(q, &q->lock);
+  r = 0;
+  if(p->futexspace || p->futexkey){
+    // Woken by kill(), not by futex_wake().
+    futexunlink(q, p);
+    r = -1;
+  }
+  if(p->killed)
+    r = -1;
+  release(&q->lock);
+  return r;
+}
+
+// Wake up to n waiters on the word at addr.
+// Returns how many were woken.
+int
+futex_wake(uint addr, int n)
+{
+  struct proc *p = myproc();
+  struct proc *w, *next;
+  struct futexq *q;
+  pde_t *space;
+  uint key;
+  int woken;
+
+  if(futexkey(p, addr, &space, &key) < 0)
+    return -1;
+  q = futexhash(space, key);
+
+  woken = 0;
+  acquire(&q->lock);
+  for(w = q->head; w && woken < n; w = next){
+    next = w->fnext;
+    if(w->futexspace != space || w->futexkey != key)
+      continue;
+    futexunlink(q, w);
+    wakeproc(w, q);
+    woken++;
+  }
+  release(&q->lock);
+  return woken;
+}
+
+int
+sys_futex_wait(void)
+{
+  int addr, val;
+
+  if(argint(0, &addr) < 0 || argint(1, &val) < 0)
+    return -1;
+  return futex_wait(addr, val);
+}
+
+int
+sys_futex_wake(void)
+{
+  int addr, n;
+
+  if(argint(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  return futex_wake(addr, n);
+}
@@ -26,15 +26,10 @@ main(void)
   for(;;){
 	
 	
-	pid = fork();
+	pid = spawn("login", argv, 0, 0);
 	if(pid<0){
-		printf(1,"init login: fork failed\n");
-		exit();
-	}
-	if(pid == 0){
-		exec("login",argv);
-		printf(1, "init: exec login failed\n");
-		exit();
+		printf(1, "init: spawn login failed\n");
+		continue;
 	}
 	while((wpid=wait()) >= 0 && wpid != pid)
 		printf(1,"zombie!\n");
@@ -21,6 +21,9 @@ struct {
   struct spinlock lock;
   int use_lock;
   struct run *freelist;
+  int nfree;       // pages on freelist
+  ushort ref[PHYSTOP/PGSIZE];  // mappings of each allocated page
+  uchar memcg[PHYSTOP/PGSIZE]; // memory group charged for it, plus 1; 0 none
 } kmem;
 
 // Initialization happens in two phases.
@@ -52,18 +55,38 @@ freerange(void *vstart, void *vend)
     kfree(p);
 }
 //PAGEBREAK: 21
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed
+// at by v, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last one.
+// (The exception is when initializing the allocator; see
+// kinit above.)
 void
 kfree(char *v)
 {
   struct run *r;
+  ushort *ref;
+  int cg;
 
   if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
     panic("kfree");
 
+  ref = &kmem.ref[V2P(v)/PGSIZE];
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  if(*ref > 1){ // still mapped elsewhere (copy-on-write)
+    (*ref)--;
+    if(kmem.use_lock)
+      release(&kmem.lock);
+    return;
+  }
+  *ref = 0;
+  cg = kmem.memcg[V2P(v)/PGSIZE] - 1;
+  kmem.memcg[V2P(v)/PGSIZE] = 0;
+  if(kmem.use_lock)
+    release(&kmem.lock);
+  if(cg >= 0)
+    memcguncharge(cg);
+
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
 
@@ -72,25 +95,83 @@ kfree(char *v)
   r = (struct run*)v;
   r->next = kmem.freelist;
   kmem.freelist = r;
+  kmem.nfree++;
   if(kmem.use_lock)
     release(&kmem.lock);
 }
 
-// Allocate one 4096-byte page of physical memory.
+// Allocate one 4096-byte page of physical memory, charged
+// to the calling process's memory group.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
 char*
 kalloc(void)
 {
   struct run *r;
+  int cg;
 
+  cg = kmem.use_lock ? memcgcur() : -1;
+  if(cg >= 0 && memcgcharge(cg) < 0)
+    return 0;
   if(kmem.use_lock)
     acquire(&kmem.lock);
   r = kmem.freelist;
-  if(r)
+  if(r){
     kmem.freelist = r->next;
+    kmem.nfree--;
+    kmem.ref[V2P(r)/PGSIZE] = 1;
+    kmem.memcg[V2P(r)/PGSIZE] = cg + 1;
+  }
   if(kmem.use_lock)
     release(&kmem.lock);
+  if(r == 0 && cg >= 0)
+    memcguncharge(cg);
   return (char*)r;
 }
 
+// Charge the page at v to group id instead, for pages the
+// caller allocates on another process's behalf.
+int
+kcharge(char *v, int id)
+{
+  int old;
+
+  if(memcgcharge(id) < 0)
+    return -1;
+  acquire(&kmem.lock);
+  old = kmem.memcg[V2P(v)/PGSIZE] - 1;
+  kmem.memcg[V2P(v)/PGSIZE] = id + 1;
+  release(&kmem.lock);
+  if(old >= 0)
+    memcguncharge(old);
+  return 0;
+}
+
+
+// Number of free pages right now.
+int
+kfreepages(void)
+{
+  return kmem.nfree;
+}
+
+// Take another reference to the allocated page at v, for
+// one more mapping of it.
+void
+kref(char *v)
+{
+  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+    panic("kref");
+  acquire(&kmem.lock);
+  if(kmem.ref[V2P(v)/PGSIZE] == 0)
+    panic("kref free");
+  kmem.ref[V2P(v)/PGSIZE]++;
+  release(&kmem.lock);
+}
+
+// How many references the page at v has.
+int
+krefcount(char *v)
+{
+  return kmem.ref[V2P(v)/PGSIZE];
+}
@@ -84,18 +84,12 @@ main()
 			}
 			retusername(userinfo);
 			
-			pid = fork();
+			pid = spawn("sh", argv, 0, 0);
 			if(pid <0){
-				printf(1,"login: fork failed\n");
+				printf(1,"login: spawn sh failed\n");
 				exit();
 			}
-			if(pid == 0){
-				exec("sh",argv);
-				printf(1,"login: exec sh failed\n");
-				exit();
-			}
-			else
-				pid = wait();
+			pid = wait();
 		}
 		else
 			printf(1,"Wrong login information\n");
@@ -0,0 +1,273 @@
+// Memory groups: a tree of named groups, rooted at group 0,
+// that processes belong to.  Every page kalloc() hands to a
+// process is charged to its group and all of the group's
+// ancestors until kfree() releases it, page tables, kernel
+// stacks and getshmem() pages included.  A charge that would
+// take any of them past its hard limit fails, as does one past
+// a soft limit while fewer than MEMCGLOWFREE pages are free.
+//
+// New processes join their creator's group and exec keeps it;
+// memcgmove() changes it.  Pages stay charged to the group
+// that allocated them.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "memcg.h"
+
+struct memcg {
+  int used;
+  int parent;
+  char name[16];
+  uint hard;                   // pages; 0 no limit
+  uint soft;                   // pages; 0 no limit
+  uint usage;
+  uint peak;
+  uint failcnt;
+  int nproc;
+};
+
+static struct {
+  struct spinlock lock;
+  struct memcg cg[NMEMCG];
+} memcgs;
+
+void
+memcginit(void)
+{
+  initlock(&memcgs.lock, "memcg");
+  memcgs.cg[0].used = 1;
+  memcgs.cg[0].parent = -1;
+  safestrcpy(memcgs.cg[0].name, "root", sizeof(memcgs.cg[0].name));
+}
+
+// The calling process's group, or -1 outside any process.
+int
+memcgcur(void)
+{
+  struct proc *p = myproc();
+
+  return p ? p->memcg : -1;
+}
+
+// Charge one page to group id and its ancestors.
+int
+memcgcharge(int id)
+{
+  struct memcg *c;
+  int g, low;
+
+  low = kfreepages() < MEMCGLOWFREE;
+  acquire(&memcgs.lock);
+  for(g = id; g >= 0; g = c->parent){
+    c = &memcgs.cg[g];
+    if((c->hard && c->usage >= c->hard) || (low && c->soft && c->usage >= c->soft)){
+      memcgs.cg[id].failcnt++;
+      release(&memcgs.lock);
+      return -1;
+    }
+  }
+  for(g = id; g >= 0; g = c->parent){
+    c = &memcgs.cg[g];
+    if(++c->usage > c->peak)
+      c->peak = c->usage;
+  }
+  release(&memcgs.lock);
+  return 0;
+}
+
+void
+memcguncharge(int id)
+{
+  int g;
+
+  acquire(&memcgs.lock);
+  for(g = id; g >= 0; g = memcgs.cg[g].parent)
+    memcgs.cg[g].usage--;
+  release(&memcgs.lock);
+}
+
+// A process joins or leaves group id.
+void
+memcgjoin(int id, int n)
+{
+  acquire(&memcgs.lock);
+  memcgs.cg[id].nproc += n;
+  release(&memcgs.lock);
+}
+
+static int
+badid(int id)
+{
+  return id < 0 || id >= NMEMCG || !memcgs.cg[id].used;
+}
+
+// Make a group under parent; admin only.  Returns its id.
+int
+memcgcreate(char *name, int parent)
+{
+  int id;
+  struct memcg *c;
+  char buf[sizeof(c->name)];
+
+  if(!myproc()->mode || name[0] == 0)
+    return -1;
+  // name may be user memory, and touching that can kalloc();
+  // copy it before taking the lock memcgcharge() needs.
+  safestrcpy(buf, name, sizeof(buf));
+  acquire(&memcgs.lock);
+  if(badid(parent)){
+    release(&memcgs.lock);
+    return -1;
+  }
+  for(id = 1; id < NMEMCG; id++){
+    c = &memcgs.cg[id];
+    if(!c->used){
+      memset(c, 0, sizeof(*c));
+      c->used = 1;
+      c->parent = parent;
+      safestrcpy(c->name, buf, sizeof(c->name));
+      release(&memcgs.lock);
+      return id;
+    }
+  }
+  release(&memcgs.lock);
+  return -1;
+}
+
+// Remove an empty group: no processes, pages or children.
+int
+memcgdelete(int id)
+{
+  struct memcg *c;
+  int i;
+
+  if(!myproc()->mode || id == 0)
+    return -1;
+  acquire(&memcgs.lock);
+  if(badid(id) || (c = &memcgs.cg[id])->nproc || c->usage)
+    goto bad;
+  for(i = 0; i < NMEMCG; i++)
+    if(memcgs.cg[i].used && memcgs.cg[i].parent == id)
+      goto bad;
+  c->used = 0;
+  release(&memcgs.lock);
+  return 0;
+
+bad:
+  release(&memcgs.lock);
+  return -1;
+}
+
+// Set a group's limits, in bytes; 0 for none.  admin only.
+int
+memcglimit(int id, int hard, int soft)
+{
+  struct memcg *c;
+
+  if(!myproc()->mode || hard < 0 || soft < 0)
+    return -1;
+  acquire(&memcgs.lock);
+  if(badid(id)){
+    release(&memcgs.lock);
+    return -1;
+  }
+  c = &memcgs.cg[id];
+  c->hard = PGROUNDUP(hard) / PGSIZE;
+  c->soft = PGROUNDUP(soft) / PGSIZE;
+  release(&memcgs.lock);
+  return 0;
+}
+
+int
+memcgstat(int id, struct memcginfo *out)
+{
+  struct memcg *c;
+
+  acquire(&memcgs.lock);
+  if(badid(id)){
+    release(&memcgs.lock);
+    return -1;
+  }
+  c = &memcgs.cg[id];
+  out->id = id;
+  out->parent = c->parent;
+  safestrcpy(out->name, c->name, sizeof(out->name));
+  out->hard = c->hard * PGSIZE;
+  out->soft = c->soft * PGSIZE;
+  out->usage = c->usage * PGSIZE;
+  out->peak = c->peak * PGSIZE;
+  out->failcnt = c->failcnt;
+  out->nproc = c->nproc;
+  release(&memcgs.lock);
+  return 0;
+}
+
+// A process leaves group from for group to, checked and
+// moved at once so that to cannot be deleted in between.
+// For memcgmove().  Returns -1 if to is not a group.
+int
+memcgswitch(int from, int to)
+{
+  acquire(&memcgs.lock);
+  if(badid(to)){
+    release(&memcgs.lock);
+    return -1;
+  }
+  memcgs.cg[from].nproc--;
+  memcgs.cg[to].nproc++;
+  release(&memcgs.lock);
+  return 0;
+}
+
+int
+sys_memcgcreate(void)
+{
+  char *name;
+  int parent;
+
+  if(argstr(0, &name) < 0 || argint(1, &parent) < 0)
+    return -1;
+  return memcgcreate(name, parent);
+}
+
+int
+sys_memcgdelete(void)
+{
+  int id;
+
+  if(argint(0, &id) < 0)
+    return -1;
+  return memcgdelete(id);
+}
+
+int
+sys_memcglimit(void)
+{
+  int id, hard, soft;
+
+  if(argint(0, &id) < 0 || argint(1, &hard) < 0 || argint(2, &soft) < 0)
+    return -1;
+  return memcglimit(id, hard, soft);
+}
+
+int
+sys_memcgstat(void)
+{
+  int id;
+  char *out;
+  struct memcginfo info;
+
+  if(argint(0, &id) < 0 || argptr(1, &out, sizeof(struct memcginfo)) < 0)
+    return -1;
+  // Fill a kernel copy: a write to user memory can fault and
+  // kalloc(), which must not happen under memcgs.lock.
+  if(memcgstat(id, &info) < 0)
+    return -1;
+  *(struct memcginfo*)out = info;
+  return 0;
+}
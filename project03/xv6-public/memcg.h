@@ -0,0 +1,13 @@
+// A memory group, as reported by memcgstat().  Sizes are in
+// bytes; a limit of 0 means none.
+struct memcginfo {
+  int id;
+  int parent;              // Parent group's id; -1 for the root
+  char name[16];
+  uint hard;               // Allocation fails past this
+  uint soft;               // ... and past this while memory is short
+  uint usage;              // Pages charged to the group and its children
+  uint peak;               // Highest usage seen
+  uint failcnt;            // Allocations refused by a limit
+  int nproc;               // Processes in the group itself
+};
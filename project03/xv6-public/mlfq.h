@@ -0,0 +1,14 @@
+// MLFQ tunables and per-level statistics, read and set
+// with the mlfqctl() system call.  Needs param.h.
+struct mlfqinfo {
+  int nlevel;              // Levels in use, 1..NMLFQ
+  int boost;               // Ticks between priority boosts
+  int quantum[NMLFQ];      // Ticks a process may run at each level
+  int promote;             // Early sleeps in a row that earn a level up; 0 never
+  // Statistics; ignored when setting.
+  uint picks[NMLFQ];       // Times a process was picked to run from the level
+  uint demotions[NMLFQ];   // Times a process used up its quantum on the level
+  uint promotions[NMLFQ];  // Times a process was promoted off the level
+  uint nrun[NMLFQ];        // Processes queued on the level right now
+  uint boosts;             // Priority boosts so far
+};
@@ -1,4 +1,4 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC      1024  // maximum number of processes; fewer if memory is short
 #define KSTACKSIZE 4096  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
@@ -11,4 +11,10 @@
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       1000  // size of file system in blocks
+#define NFREESTACK   16  // reaped thread stacks a process keeps for reuse
+#define NMLFQ         8  // maximum number of MLFQ levels
+#define RTMAXUTIL   800  // real-time load allowed, per mille of one cpu
+#define RTMAXPERIOD 100000  // longest real-time period in ticks
 
+#define NMEMCG       16  // memory groups, root included
+#define MEMCGLOWFREE 256 // free pages below which soft limits are enforced
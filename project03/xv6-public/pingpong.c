@@ -0,0 +1,61 @@
+// Pipe ping-pong: a parent and a child bounce one byte
+// through two pipes and the time per round trip is
+// reported. Each side wakes the other and then blocks,
+// which is the case a direct handoff in sched() speeds up.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define NROUND 10000
+
+int
+main(int argc, char *argv[])
+{
+  int ping[2], pong[2];
+  int i, n, pid, start, elapsed;
+  char c;
+
+  n = argc > 1 ? atoi(argv[1]) : NROUND;
+  if(n <= 0){
+    printf(2, "usage: pingpong [rounds]\n");
+    exit();
+  }
+  if(pipe(ping) < 0 || pipe(pong) < 0){
+    printf(2, "pingpong: pipe failed\n");
+    exit();
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf(2, "pingpong: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    close(ping[1]);
+    close(pong[0]);
+    while(read(ping[0], &c, 1) == 1)
+      write(pong[1], &c, 1);
+    exit();
+  }
+
+  close(ping[0]);
+  close(pong[1]);
+  c = 'x';
+  start = uptime();
+  for(i = 0; i < n; i++){
+    if(write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1){
+      printf(2, "pingpong: round %d failed\n", i);
+      break;
+    }
+  }
+  elapsed = uptime() - start;
+  close(ping[1]);
+  wait();
+
+  printf(1, "%d round trips in %d ticks", i, elapsed);
+  if(elapsed > 0)
+    printf(1, ", %d per tick", i / elapsed);
+  printf(1, "\n");
+  exit();
+}
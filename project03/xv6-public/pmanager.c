@@ -7,11 +7,20 @@
 #include "syscall.h"
 #include "traps.h"
 #include "memlayout.h"
+#include "mlfq.h"
+#include "pstat.h"
+#include "spawn.h"
+#include "memcg.h"
 
 #define BUFSIZE 1024
 
 int getcmd(char *buf, int nbuf);
+void mlfqcmd(char *buf);
+void topcmd(char *buf);
+void cgcmd(char *buf);
+int getnum(char *buf, int *index);
 char *argv[10];
+struct spawnfd detach[] = { { SPAWN_DETACH }, { SPAWN_END } };
 
 int
 main() 
@@ -94,7 +103,6 @@ main()
 				buf[6] == 'e' && buf[7] == ' ') {
 			int index = 8;
 			int stacksize = 0;
-			int pid;
 			char path[BUFSIZE];
 			int path_index = 0;
 
@@ -133,31 +141,9 @@ main()
 				continue;
 			}
 
-			pid = fork();
-
-			if(pid == 0) {
-				pid = fork();
-				if(pid == 0) {
-					if(getadmin(password) == -1) {
-						printf(1, "get admin failed\n");
-						exit();
-					}
-
-					exec2(argv[0], argv, stacksize);
-					printf(1, "failed to exec\n");
-				} 
-				else if(pid < 0) {
-					printf(1, "fork failed\n");
-				}
-				exit();
-
-			} 
-			else if(pid > 0) {
-				wait();
-			} 
-			else {
-				printf(1, "failed to fork\n");
-			}
+			// Detached, so init reaps it and we don't wait.
+			if(stacksize < 1 || spawn(argv[0], argv, stacksize, detach) < 0)
+				printf(1, "failed to exec\n");
 		} 
 
 		// memlim
@@ -212,6 +198,49 @@ main()
 			}		
 		} 
 
+		// affinity
+		else if(buf[0] == 'a' && buf[1] == 'f' && 
+				buf[2] == 'f' && buf[3] == 'i' && 
+				buf[4] == 'n' && buf[5] == 'i' &&
+				buf[6] == 't' && buf[7] == 'y' &&
+				buf[8] == ' ') {
+			int index = 8;
+			int pid, mask;
+
+			if((pid = getnum(buf, &index)) < 0 || (mask = getnum(buf, &index)) < 0) {
+				printf(1, "Usage: affinity <pid> <cpu mask>\n");
+				continue;
+			}
+
+			if(setaffinity(pid, mask) == -1) {
+				printf(1, "setaffinity failed!\n");
+			} 
+			else {
+				printf(1, "set affinity success!\n");
+				printf(1, "\n");
+			}
+		} 
+
+		// top
+		else if(buf[0] == 't' && buf[1] == 'o' && 
+				buf[2] == 'p' && 
+				(buf[3] == ' ' || buf[3] == '\n')) {
+			topcmd(buf);
+		} 
+
+		// mlfq
+		else if(buf[0] == 'm' && buf[1] == 'l' && 
+				buf[2] == 'f' && buf[3] == 'q' && 
+				(buf[4] == ' ' || buf[4] == '\n')) {
+			mlfqcmd(buf + 4);
+		} 
+
+		// cg
+		else if(buf[0] == 'c' && buf[1] == 'g' && 
+				(buf[2] == ' ' || buf[2] == '\n')) {
+			cgcmd(buf + 2);
+		} 
+
 		// no input
 		else if(buf[0] == '\n') {
 		}
@@ -238,3 +267,259 @@ getcmd(char *buf, int nbuf)
 		return -1;
 	return 0;
 }
+
+// Parse the next number in buf at *index, skipping one blank.
+// Returns -1 if there is none.
+int
+getnum(char *buf, int *index)
+{
+	int n = 0;
+
+	if(buf[*index] != ' ')
+		return -1;
+	(*index)++;
+	if(buf[*index] < 48 || buf[*index] > 57)
+		return -1;
+	while(48 <= buf[*index] && buf[*index] <= 57) {
+		n *= 10;
+		n += buf[*index] - 48;
+		(*index)++;
+	}
+	if(buf[*index] != ' ' && buf[*index] != '\n')
+		return -1;
+	return n;
+}
+
+// mlfq                          show tunables and statistics
+// mlfq levels <n>               use n levels
+// mlfq boost <ticks>            boost every <ticks> ticks
+// mlfq promote <n>              promote after n early sleeps, 0 never
+// mlfq quantum <level> <ticks>  set the quantum of a level
+void
+mlfqcmd(char *buf)
+{
+	struct mlfqinfo info;
+	int index, lev, n;
+
+	if(mlfqctl(0, &info) == -1) {
+		printf(1, "mlfq failed\n");
+		return;
+	}
+
+	if(buf[0] == '\n') {
+		printf(1, "levels %d, boost every %d ticks, %d boosts, "
+				"promote after %d early sleeps\n",
+				info.nlevel, info.boost, info.boosts, info.promote);
+		printf(1, "LEVEL\tQUANTUM\tQUEUED\tPICKS\tDEMOTED\tPROMOTED\n");
+		for(lev = 0; lev < info.nlevel; lev++)
+			printf(1, "%d\t%d\t%d\t%d\t%d\t%d\n", lev, info.quantum[lev],
+					info.nrun[lev], info.picks[lev], info.demotions[lev],
+					info.promotions[lev]);
+		return;
+	}
+
+	if(strlen(buf) > 7 && buf[1] == 'l' && buf[2] == 'e' &&
+			buf[3] == 'v' && buf[4] == 'e' && buf[5] == 'l' &&
+			buf[6] == 's') {
+		index = 7;
+		if((n = getnum(buf, &index)) < 0) {
+			printf(1, "Usage: mlfq levels <n>\n");
+			return;
+		}
+		info.nlevel = n;
+	} 
+	else if(strlen(buf) > 6 && buf[1] == 'b' && buf[2] == 'o' &&
+			buf[3] == 'o' && buf[4] == 's' && buf[5] == 't') {
+		index = 6;
+		if((n = getnum(buf, &index)) < 0) {
+			printf(1, "Usage: mlfq boost <ticks>\n");
+			return;
+		}
+		info.boost = n;
+	} 
+	else if(strlen(buf) > 8 && buf[1] == 'p' && buf[2] == 'r' &&
+			buf[3] == 'o' && buf[4] == 'm' && buf[5] == 'o' &&
+			buf[6] == 't' && buf[7] == 'e') {
+		index = 8;
+		if((n = getnum(buf, &index)) < 0) {
+			printf(1, "Usage: mlfq promote <n>\n");
+			return;
+		}
+		info.promote = n;
+	} 
+	else if(strlen(buf) > 8 && buf[1] == 'q' && buf[2] == 'u' &&
+			buf[3] == 'a' && buf[4] == 'n' && buf[5] == 't' &&
+			buf[6] == 'u' && buf[7] == 'm') {
+		index = 8;
+		if((lev = getnum(buf, &index)) < 0 || (n = getnum(buf, &index)) < 0 ||
+				lev >= NMLFQ) {
+			printf(1, "Usage: mlfq quantum <level> <ticks>\n");
+			return;
+		}
+		info.quantum[lev] = n;
+	} 
+	else {
+		printf(1, "Usage: mlfq [levels <n> | boost <ticks> | promote <n> |"
+				" quantum <level> <ticks>]\n");
+		return;
+	}
+
+	if(mlfqctl(&info, 0) == -1)
+		printf(1, "mlfq failed\n");
+	else
+		printf(1, "mlfq set\n");
+}
+
+// top            processes by cpu used in all
+// top <ticks>    processes by cpu used over the next <ticks>
+void
+topcmd(char *buf)
+{
+	static struct pstat before[NPROC], now[NPROC];
+	static char *states[] = { "unused", "embryo", "sleep", "runble", "run", "zombie" };
+	static uint used[NPROC], wait[NPROC];
+	static int order[NPROC];
+	int index = 3, interval = 0, nbefore = 0, n, i, j, k;
+
+	if(buf[index] == ' ' && (interval = getnum(buf, &index)) <= 0) {
+		printf(1, "Usage: top [ticks]\n");
+		return;
+	}
+	if(interval) {
+		if((nbefore = getpstat(before, NPROC)) < 0) {
+			printf(1, "getpstat failed\n");
+			return;
+		}
+		sleep(interval);
+	}
+	if((n = getpstat(now, NPROC)) < 0) {
+		printf(1, "getpstat failed\n");
+		return;
+	}
+
+	// cpu and wait ticks, over the interval if there is one
+	for(i = 0; i < n; i++) {
+		used[i] = now[i].cputicks;
+		wait[i] = now[i].waitticks;
+		for(j = 0; j < nbefore; j++) {
+			if(before[j].pid == now[i].pid) {
+				used[i] -= before[j].cputicks;
+				wait[i] -= before[j].waitticks;
+				break;
+			}
+		}
+	}
+
+	// most cpu first
+	for(i = 0; i < n; i++) {
+		for(j = i; j > 0 && used[order[j-1]] < used[i]; j--)
+			order[j] = order[j-1];
+		order[j] = i;
+	}
+
+	printf(1, "PID\tSTATE\tLEVEL\tCPU\tTIME\tWAIT\tVCSW\tIVCSW\tNAME\n");
+	for(i = 0; i < n; i++) {
+		k = order[i];
+		printf(1, "%d\t%s\t", now[k].pid, states[now[k].state]);
+		if(now[k].level < 0)
+			printf(1, "-\t");
+		else
+			printf(1, "%d\t", now[k].level);
+		if(now[k].cpu < 0)
+			printf(1, "-\t");
+		else
+			printf(1, "%d\t", now[k].cpu);
+		printf(1, "%d\t%d\t%d\t%d\t%s\n", used[k], wait[k],
+				now[k].nvcsw, now[k].nivcsw, now[k].name);
+	}
+}
+
+// cg                                  show memory groups and usage
+// cg create <name> <parent>           make a group, print its id
+// cg limit <id> <hard> <soft>         set limits in bytes, 0 none
+// cg move <pid> <id>                  move a process to a group
+// cg delete <id>                      remove an empty group
+void
+cgcmd(char *buf)
+{
+	struct memcginfo info;
+	char name[16];
+	int index, id, a, b, i;
+
+	if(buf[0] == '\n') {
+		printf(1, "ID\tNAME\t\tPARENT\tPROCS\tUSAGE\tPEAK\tHARD\tSOFT\tFAILS\n");
+		for(id = 0; id < NMEMCG; id++) {
+			if(memcgstat(id, &info) < 0)
+				continue;
+			printf(1, "%d\t%s\t", info.id, info.name);
+			if(strlen(info.name) < 8)
+				printf(1, "\t");
+			printf(1, "%d\t%d\t%d\t%d\t%d\t%d\t%d\n", info.parent, info.nproc,
+					info.usage, info.peak, info.hard, info.soft, info.failcnt);
+		}
+		return;
+	}
+
+	if(strlen(buf) > 7 && buf[1] == 'c' && buf[2] == 'r' &&
+			buf[3] == 'e' && buf[4] == 'a' && buf[5] == 't' &&
+			buf[6] == 'e' && buf[7] == ' ') {
+		index = 8;
+		for(i = 0; buf[index] != ' ' && buf[index] != '\n' &&
+				i < sizeof(name) - 1; i++)
+			name[i] = buf[index++];
+		name[i] = 0;
+		if(i == 0 || (a = getnum(buf, &index)) < 0) {
+			printf(1, "Usage: cg create <name> <parent>\n");
+			return;
+		}
+		if((id = memcgcreate(name, a)) < 0)
+			printf(1, "cg failed\n");
+		else
+			printf(1, "created group %d\n", id);
+		return;
+	}
+	else if(strlen(buf) > 6 && buf[1] == 'l' && buf[2] == 'i' &&
+			buf[3] == 'm' && buf[4] == 'i' && buf[5] == 't') {
+		index = 6;
+		if((id = getnum(buf, &index)) < 0 || (a = getnum(buf, &index)) < 0 ||
+				(b = getnum(buf, &index)) < 0) {
+			printf(1, "Usage: cg limit <id> <hard> <soft>\n");
+			return;
+		}
+		if(memcglimit(id, a, b) < 0) {
+			printf(1, "cg failed\n");
+			return;
+		}
+	}
+	else if(strlen(buf) > 5 && buf[1] == 'm' && buf[2] == 'o' &&
+			buf[3] == 'v' && buf[4] == 'e') {
+		index = 5;
+		if((a = getnum(buf, &index)) < 0 || (id = getnum(buf, &index)) < 0) {
+			printf(1, "Usage: cg move <pid> <id>\n");
+			return;
+		}
+		if(memcgmove(a, id) < 0) {
+			printf(1, "cg failed\n");
+			return;
+		}
+	}
+	else if(strlen(buf) > 7 && buf[1] == 'd' && buf[2] == 'e' &&
+			buf[3] == 'l' && buf[4] == 'e' && buf[5] == 't' &&
+			buf[6] == 'e') {
+		index = 7;
+		if((id = getnum(buf, &index)) < 0) {
+			printf(1, "Usage: cg delete <id>\n");
+			return;
+		}
+		if(memcgdelete(id) < 0) {
+			printf(1, "cg failed\n");
+			return;
+		}
+	}
+	else {
+		printf(1, "Usage: cg [create <name> <parent> | limit <id> <hard> <soft> |"
+				" move <pid> <id> | delete <id>]\n");
+		return;
+	}
+	printf(1, "cg set\n");
+}
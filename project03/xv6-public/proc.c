@@ -4,28 +4,284 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "x86.h"
-#include "proc.h"
+#include "traps.h"
 #include "spinlock.h"
+#include "spawn.h"
+#include "proc.h"
+#include "mlfq.h"
+#include "pstat.h"
 //#include "file.h"
 
+#define NPIDHASH 64  // pid hash chains; a power of two
+#define PROCPAGES 64 // pages a small process needs, page tables and all
+
+// Process descriptors are carved out of whole pages as they
+// are needed (procgrow()) and never given back. Every one
+// is on the all list, in the order made; since the list
+// only grows it may be walked without lock. Slots in use
+// hang off pidhash by pid and UNUSED ones are on free, so
+// allocproc() and lookups by pid do not walk the list.
+// At most maxproc slots, set from free memory at boot, are
+// in use at once. All else is guarded by lock.
 struct {
   struct spinlock lock;
-  struct proc proc[NPROC];
+  struct proc *all;
+  struct proc **alltail;
+  struct proc *pidhash[NPIDHASH];
+  struct proc *free;
+  int nproc;                   // slots not UNUSED
+  int maxproc;
 } ptable;
 
 static struct proc *initproc;
 
+// Sleeping processes, hashed by the channel they sleep on, so
+// wakeup() only looks at processes that might match.  A
+// process is on its bucket from sleep() until it runs again
+// or a wakeup() takes it off.  Lock order: a bucket's lock,
+// then p->lock.
+#define NSLEEPHASH 64  // a power of two
+
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;
+} sleepq[NSLEEPHASH];
+
+static struct sleepq*
+sleephash(void *chan)
+{
+  return &sleepq[((uint)chan * 2654435761u) >> 26];
+}
+
+// Timed sleepers (sleeptimeout()) on a timer wheel: slot
+// deadline%NTIMERSLOT, so each tick visits one slot rather
+// than waking every sleeper to check the time.  Lock order:
+// a sleep bucket's lock, timers.lock, then p->lock.
+#define NTIMERSLOT 64
+
+struct {
+  struct spinlock lock;
+  uint now;                    // last tick serviced by timertick()
+  struct proc *slot[NTIMERSLOT];
+} timers;
+
+// Caller holds timers.lock.
+static void
+timerlink(struct proc *p, uint deadline)
+{
+  struct proc **head;
+
+  head = &timers.slot[deadline % NTIMERSLOT];
+  p->tdeadline = deadline;
+  p->ontimer = 1;
+  p->tprev = 0;
+  p->tnext = *head;
+  if(*head)
+    (*head)->tprev = p;
+  *head = p;
+}
+
+static void
+timerunlink(struct proc *p)
+{
+  if(p->tprev)
+    p->tprev->tnext = p->tnext;
+  else
+    timers.slot[p->tdeadline % NTIMERSLOT] = p->tnext;
+  if(p->tnext)
+    p->tnext->tprev = p->tprev;
+  p->tnext = p->tprev = 0;
+  p->ontimer = 0;
+}
+
+// Something other than the timer is waking p: take it off
+// the wheel first, so that a tick due before p runs again
+// cannot claim the wakeup and sleeptimeout() report a
+// timeout.  ontimer only goes from 0 to 1 in sleep1(),
+// before p's wakers can find it, so it is safe to test
+// without the lock.
+static void
+timercancel(struct proc *p)
+{
+  if(!p->ontimer)
+    return;
+  acquire(&timers.lock);
+  if(p->ontimer)
+    timerunlink(p);
+  release(&timers.lock);
+}
+
+// MLFQ tunables, changed at run time through mlfqctl(),
+// and statistics.  MLFQ_K from the Makefile is the number
+// of levels in use at boot.
+struct mlfqinfo mlfq = {
+  .nlevel = MLFQ_K < 1 ? 1 : MLFQ_K > NMLFQ ? NMLFQ : MLFQ_K,
+  .boost = 100,
+  .quantum = { 4, 6, 8, 10, 12, 14, 16, 18 },
+  .promote = 3,
+};
+
+// Bumped by each priority boost. Processes and run queues
+// remember the epoch they were last boosted in and catch
+// up (renormalize()) when they are next looked at, so a
+// boost never has to visit them.
+uint boostepoch;
+
+// Sum of rtutil over all processes, per mille of a cpu.
+// Guarded by ptable.lock.
+int rtload;
+
 int nextpid = 1;
 extern void forkret(void);
 extern void trapret(void);
 
-static void wakeup1(void *chan);
 int openfile(char *path);
 
 void
 pinit(void)
 {
+  struct cpu *c;
+
+  struct sleepq *q;
+
   initlock(&ptable.lock, "ptable");
+  ptable.alltail = &ptable.all;
+  for(q = sleepq; q < &sleepq[NSLEEPHASH]; q++)
+    initlock(&q->lock, "sleepq");
+  initlock(&timers.lock, "timers");
+  for(c = cpus; c < &cpus[NCPU]; c++)
+    initlock(&c->rq.lock, "runq");
+}
+
+// Carve a fresh page into descriptors for the free list.
+// Caller holds ptable.lock.
+static int
+procgrow(void)
+{
+  struct proc *p, *e;
+  char *page;
+
+  if((page = kalloc()) == 0)
+    return -1;
+  memset(page, 0, PGSIZE);
+  e = (struct proc*)page + PGSIZE/sizeof(struct proc);
+  for(p = (struct proc*)page; p < e; p++){
+    initlock(&p->lock, "proc");
+    p->hnext = ptable.free;
+    ptable.free = p;
+    __sync_synchronize(); // p is whole before walkers see it
+    *ptable.alltail = p;
+    ptable.alltail = &p->allnext;
+  }
+  return 0;
+}
+
+static struct proc**
+pidchain(int pid)
+{
+  return &ptable.pidhash[pid & (NPIDHASH-1)];
+}
+
+// The process with this pid, or 0. Caller holds ptable.lock.
+static struct proc*
+findproc(int pid)
+{
+  struct proc *p;
+
+  if(pid <= 0)
+    return 0;
+  for(p = *pidchain(pid); p; p = p->hnext)
+    if(p->pid == pid)
+      return p;
+  return 0;
+}
+
+// Each process's children hang off p->children while they
+// run and p->zombies once they have exited, linked through
+// sibnext/sibprev.  Caller holds ptable.lock.
+static void
+kidlink(struct proc **head, struct proc *p)
+{
+  p->sibprev = 0;
+  p->sibnext = *head;
+  if(*head)
+    (*head)->sibprev = p;
+  *head = p;
+}
+
+static void
+kidunlink(struct proc **head, struct proc *p)
+{
+  if(p->sibprev)
+    p->sibprev->sibnext = p->sibnext;
+  else
+    *head = p->sibnext;
+  if(p->sibnext)
+    p->sibnext->sibprev = p->sibprev;
+  p->sibnext = p->sibprev = 0;
+}
+
+// Give every process on *from to parent, moving them to *to.
+// Returns 1 if any moved.
+static int
+kidsplice(struct proc **to, struct proc **from, struct proc *parent)
+{
+  struct proc *p;
+
+  if(*from == 0)
+    return 0;
+  for(p = *from; ; p = p->sibnext){
+    p->parent = parent;
+    if(p->sibnext == 0)
+      break;
+  }
+  p->sibnext = *to;
+  if(*to)
+    (*to)->sibprev = p;
+  *to = *from;
+  *from = 0;
+  return 1;
+}
+
+static void
+setparent(struct proc *p, struct proc *parent)
+{
+  p->parent = parent;
+  p->ppid = parent->pid;
+  kidlink(&parent->children, p);
+}
+
+// Threads share one address space, so a change of size
+// applies to the whole group.  Caller holds ptable.lock.
+static void
+setgroupsz(struct proc *leader, uint sz)
+{
+  struct proc *t;
+
+  leader->sz = sz;
+  for(t = leader->threads; t; t = t->sibnext)
+    t->sz = sz;
+}
+
+// Return p's slot: out of the pid hash, onto the free list.
+// Caller holds ptable.lock.
+static void
+freeproc(struct proc *p)
+{
+  struct proc **pp;
+
+  for(pp = pidchain(p->pid); *pp; pp = &(*pp)->hnext){
+    if(*pp == p){
+      *pp = p->hnext;
+      break;
+    }
+  }
+  memcgjoin(p->memcg, -1);
+  p->pid = 0;
+  p->state = UNUSED;
+  p->hnext = ptable.free;
+  ptable.free = p;
+  ptable.nproc--;
 }
 
 // Must be called with interrupts disabled
@@ -80,6 +336,696 @@ myproc(void) {
 
 
 
+//PAGEBREAK: 40
+// Run queues.
+//
+// Each CPU keeps the RUNNABLE processes it is going to run
+// in cpu->rq, guarded by cpu->rq.lock. A process that becomes
+// RUNNABLE goes back on the queue of the CPU it last ran on,
+// or else of the CPU that made it so (fork, wakeup, yield),
+// within its affinity mask; a CPU whose queue is empty
+// steals from the busiest one. SCHED_POLICY decides how a
+// queue is ordered and what comes off it next (rqpick()):
+//   DEFAULT           one FIFO, round robin
+//   MULTILEVEL_SCHED  even pids round robin ahead of odd
+//                     pids, which come off a heap lowest
+//                     pid first
+//   MLFQ_SCHED        one list per level plus sys/expired
+//   STRIDE_SCHED      a heap, lowest pass first
+// Real-time processes (setrealtime()) sit in a separate
+// heap, earliest deadline first, ahead of every policy.
+//
+// Locks are taken in the order ptable.lock, p->lock, rq->lock.
+
+// Bit for cpu c in a proc's affinity mask.
+#define CPUBIT(c) (1 << ((c) - cpus))
+
+#ifdef MLFQ_SCHED
+// Insert p into q behind every process of equal or
+// higher priority. The common case, equal priority,
+// stops at the tail.
+static void
+qinsert(struct procq *q, struct proc *p)
+{
+  struct proc *prev;
+
+  if(p->pq)
+    panic("qinsert");
+  for(prev = q->tail; prev && prev->priority < p->priority; prev = prev->qprev)
+    ;
+  p->qprev = prev;
+  if(prev){
+    p->qnext = prev->qnext;
+    prev->qnext = p;
+  } else {
+    p->qnext = q->head;
+    q->head = p;
+  }
+  if(p->qnext)
+    p->qnext->qprev = p;
+  else
+    q->tail = p;
+  p->pq = q;
+}
+#elif !defined(STRIDE_SCHED)
+static void
+qappend(struct procq *q, struct proc *p)
+{
+  if(p->pq)
+    panic("qappend");
+  p->qnext = 0;
+  p->qprev = q->tail;
+  if(q->tail)
+    q->tail->qnext = p;
+  else
+    q->head = p;
+  q->tail = p;
+  p->pq = q;
+}
+#endif
+
+// Heap order: lowest hkey first. Keys are compared as a
+// difference so that tick deadlines may wrap around.
+static int
+heapless(struct proc *a, struct proc *b)
+{
+  return (int)(a->hkey - b->hkey) < 0;
+}
+
+static void
+heapset(struct procheap *h, int i, struct proc *p)
+{
+  h->p[i] = p;
+  p->hidx = i;
+}
+
+// Move the entry at i up or down until it is in order.
+static void
+heapfix(struct procheap *h, int i)
+{
+  struct proc *p = h->p[i];
+  int c;
+
+  while(i > 0 && heapless(p, h->p[(i-1)/2])){
+    heapset(h, i, h->p[(i-1)/2]);
+    i = (i-1)/2;
+  }
+  for(;;){
+    c = 2*i + 1;
+    if(c >= h->n)
+      break;
+    if(c+1 < h->n && heapless(h->p[c+1], h->p[c]))
+      c++;
+    if(!heapless(h->p[c], p))
+      break;
+    heapset(h, i, h->p[c]);
+    i = c;
+  }
+  heapset(h, i, p);
+}
+
+static void
+heappush(struct procheap *h, struct proc *p)
+{
+  if(p->pq || p->ph || h->n == NPROC)
+    panic("heappush");
+  heapset(h, h->n++, p);
+  heapfix(h, h->n - 1);
+  p->ph = h;
+}
+
+static void
+heapremove(struct procheap *h, struct proc *p)
+{
+  int i = p->hidx;
+
+  if(p->ph != h || i >= h->n || h->p[i] != p)
+    panic("heapremove");
+  h->n--;
+  if(i != h->n){
+    heapset(h, i, h->p[h->n]);
+    heapfix(h, i);
+  }
+  p->ph = 0;
+}
+
+static void
+qremove(struct proc *p)
+{
+  struct procq *q = p->pq;
+
+  if(q == 0)
+    panic("qremove");
+  if(p->qprev)
+    p->qprev->qnext = p->qnext;
+  else
+    q->head = p->qnext;
+  if(p->qnext)
+    p->qnext->qprev = p->qprev;
+  else
+    q->tail = p->qprev;
+  p->qnext = p->qprev = 0;
+  p->pq = 0;
+}
+
+#ifdef MLFQ_SCHED
+// The list of rq that p belongs on.
+static struct procq*
+mlfqlist(struct runq *rq, struct proc *p)
+{
+  if(p->pid == 1 || p->pid == 2)
+    return &rq->sys;
+  renormalize(p);
+  if(p->lastqueue)
+    return &rq->expired;
+  return &rq->level[p->queue];
+}
+
+static void
+boost(struct proc *p)
+{
+  p->queue = L0;
+  p->ticks = 0;
+  p->lastqueue = 0;
+  p->epoch = boostepoch;
+  p->earlysleeps = 0;
+  p->woke = 0;
+}
+
+// Apply any priority boost p has missed, and move p down to
+// the last level if mlfqctl() took its level away. Caller
+// owns p's MLFQ fields: p is running on this cpu, or is not
+// queued and caller holds p->lock, or caller holds
+// p->rq->lock.
+void
+renormalize(struct proc *p)
+{
+  if(p->epoch != boostepoch)
+    boost(p);
+  if(p->queue >= mlfq.nlevel)
+    p->queue = mlfq.nlevel - 1;
+}
+
+// p, running, is about to block in sleep(). If it has not
+// used up its quantum it keeps its level and starts the
+// next quantum afresh, so I/O-bound processes do not sink
+// by the ticks they use between waits. mlfq.promote early
+// sleeps in a row move it up a level.
+static void
+sleepcredit(struct proc *p)
+{
+  int lev;
+
+  renormalize(p);
+  lev = p->queue;
+  if(p->lastqueue || p->ticks > mlfq.quantum[lev]){
+    p->earlysleeps = 0;
+    return;
+  }
+  p->ticks = 0;
+  if(mlfq.promote && ++p->earlysleeps >= mlfq.promote){
+    p->earlysleeps = 0;
+    if(lev > L0){
+      p->queue = lev - 1;
+      __sync_fetch_and_add(&mlfq.promotions[lev], 1);
+    }
+  }
+}
+
+// Move everything queued on rq below L0 back to L0.
+static void
+rqboost(struct runq *rq)
+{
+  struct proc *p;
+  int lev;
+
+  rq->epoch = boostepoch;
+  for(lev = 1; lev < NMLFQ; lev++){
+    while((p = rq->level[lev].head) != 0){
+      qremove(p);
+      boost(p);
+      qinsert(&rq->level[L0], p);
+    }
+  }
+  while((p = rq->expired.head) != 0){
+    qremove(p);
+    boost(p);
+    qinsert(&rq->level[L0], p);
+  }
+}
+#endif
+
+#ifdef STRIDE_SCHED
+// Stride scheduling. A process holds priority+1 tickets
+// and its pass goes up by STRIDE1/tickets for every tick
+// of cpu it uses (chargetime()); the lowest pass runs
+// next, so cpu time is shared in proportion to tickets.
+// A process joining a queue starts no lower than the pass
+// of the one picked last there (vpass): sleeping earns
+// no credit it could use to take the cpu over.
+#define STRIDE1 (1 << 16)
+
+static uint
+stridefor(int priority)
+{
+  return STRIDE1 / (priority + 1);
+}
+#endif
+
+// Real-time class. A process that has declared (runtime,
+// period) is run earliest deadline first, ahead of the
+// policy, for up to runtime ticks per period. Past that it
+// is throttled: it runs in the ordinary class until the
+// period ends. Admission keeps the total rtruntime/rtperiod
+// within RTMAXUTIL per mille of one cpu, so real-time
+// processes can neither miss deadlines nor starve the rest,
+// even if all of them end up on one cpu.
+
+// Start p's next period if the current one is over.
+// Caller owns p as for renormalize().
+static void
+rtrefresh(struct proc *p)
+{
+  if(p->rtruntime == 0 || (int)(ticks - p->rtdeadline) < 0)
+    return;
+  p->rtdeadline = ticks + p->rtperiod;
+  p->rtused = 0;
+  p->rtthrottled = 0;
+}
+
+static int
+rtactive(struct proc *p)
+{
+  return p->rtruntime > 0 && !p->rtthrottled;
+}
+
+// Add n to the tallies in rq->nallow of the cpus in mask.
+// Caller holds rq->lock.
+static void
+rqallow(struct runq *rq, int mask, int n)
+{
+  int i;
+
+  for(i = 0; i < ncpu; i++)
+    if(mask & (1 << i))
+      rq->nallow[i] += n;
+}
+
+// A throttled real-time process waits in the policy's lists
+// until its next period, and is also kept on rq->throttled
+// so that rtreplenish() can move it back to the heap then.
+// Caller holds rq->lock.
+static void
+throttledlink(struct runq *rq, struct proc *p)
+{
+  p->thprev = 0;
+  p->thnext = rq->throttled;
+  if(rq->throttled)
+    rq->throttled->thprev = p;
+  rq->throttled = p;
+  p->onthrottled = 1;
+}
+
+static void
+throttledunlink(struct runq *rq, struct proc *p)
+{
+  if(p->thprev)
+    p->thprev->thnext = p->thnext;
+  else
+    rq->throttled = p->thnext;
+  if(p->thnext)
+    p->thnext->thprev = p->thprev;
+  p->thnext = p->thprev = 0;
+  p->onthrottled = 0;
+}
+
+// Queue p on rq. Caller holds rq->lock.
+static void
+rqadd(struct runq *rq, struct proc *p)
+{
+  if(p->rq)
+    panic("rqadd");
+  rtrefresh(p);
+  if(rtactive(p)){
+    p->hkey = p->rtdeadline;
+    heappush(&rq->rt, p);
+  } else {
+#ifdef MLFQ_SCHED
+  qinsert(mlfqlist(rq, p), p);
+#elif MULTILEVEL_SCHED
+  if(p->pid == 1 || p->pid == 2 || p->pid % 2 == 0)
+    qappend(&rq->even, p);
+  else {
+    p->hkey = p->pid;
+    heappush(&rq->odd, p);
+  }
+#elif STRIDE_SCHED
+  if((int)(p->pass - rq->vpass) < 0)
+    p->pass = rq->vpass;
+  p->hkey = p->pass;
+  heappush(&rq->stride, p);
+#else
+  qappend(&rq->q, p);
+#endif
+  if(p->rtruntime > 0)
+    throttledlink(rq, p);
+  }
+  p->rq = rq;
+  rq->nrun++;
+  rqallow(rq, p->affinity, 1);
+}
+
+static void
+rqdel(struct runq *rq, struct proc *p)
+{
+  if(p->ph)
+    heapremove(p->ph, p);
+  else
+    qremove(p);
+  if(p->onthrottled)
+    throttledunlink(rq, p);
+  p->rq = 0;
+  rq->nrun--;
+  rqallow(rq, p->affinity, -1);
+}
+
+#ifdef MULTILEVEL_SCHED
+// Take the first of init, login and the even pids; if
+// there are none, the lowest odd pid (first come first
+// served). Returns 0 if rq is empty. Caller holds rq->lock.
+static struct proc*
+policypick(struct runq *rq)
+{
+  struct proc *p;
+
+  if((p = rq->even.head) == 0 && rq->odd.n > 0)
+    p = rq->odd.p[0];
+  if(p)
+    rqdel(rq, p);
+  return p;
+}
+#elif MLFQ_SCHED
+// Take the next process off the highest non-empty level.
+// A process found over its level's quantum is demoted and
+// the search goes on; when only expired processes are left
+// they are boosted back to L0. A queue that has missed a
+// priority boost catches up here first, in one pass.
+// Caller holds rq->lock.
+static struct proc*
+policypick(struct runq *rq)
+{
+  struct proc *p;
+  int lev, nlevel;
+
+  if((p = rq->sys.head) != 0){
+    rqdel(rq, p);
+    return p;
+  }
+  if(rq->epoch != boostepoch)
+    rqboost(rq);
+  for(;;){
+    nlevel = mlfq.nlevel;
+    for(lev = 0; lev < nlevel; lev++)
+      if(rq->level[lev].head)
+        break;
+    if(lev == nlevel){
+      if(rq->expired.head == 0)
+        return 0;
+      rqboost(rq);
+      __sync_fetch_and_add(&mlfq.boosts, 1);
+      continue;
+    }
+    p = rq->level[lev].head;
+    if(p->ticks > mlfq.quantum[lev]){
+      qremove(p);
+      if(lev < nlevel - 1){ // it is not last queue
+        p->queue = lev+1;
+        p->ticks = 0;
+      } else
+        p->lastqueue = 1; // it's finished. wait boosting
+      p->earlysleeps = 0;
+      __sync_fetch_and_add(&mlfq.demotions[lev], 1);
+      qinsert(mlfqlist(rq, p), p);
+      continue;
+    }
+    rqdel(rq, p);
+    __sync_fetch_and_add(&mlfq.picks[lev], 1);
+    return p;
+  }
+}
+#elif STRIDE_SCHED
+// Take the process with the lowest pass. Caller holds
+// rq->lock.
+static struct proc*
+policypick(struct runq *rq)
+{
+  struct proc *p;
+
+  if(rq->stride.n == 0)
+    return 0;
+  p = rq->stride.p[0];
+  rq->vpass = p->pass;
+  rqdel(rq, p);
+  return p;
+}
+#else
+static struct proc*
+policypick(struct runq *rq)
+{
+  struct proc *p;
+
+  if((p = rq->q.head) != 0)
+    rqdel(rq, p);
+  return p;
+}
+#endif
+
+// Take the real-time process with the earliest deadline,
+// else whatever the policy picks.
+static struct proc*
+rqpick(struct runq *rq)
+{
+  struct proc *p;
+
+  if(rq->rt.n > 0){
+    p = rq->rt.p[0];
+    rqdel(rq, p);
+    return p;
+  }
+  return policypick(rq);
+}
+
+// Would the policy pick p, queued on rq, next anyway? Only
+// then may a handoff run it, so that it never jumps ahead
+// of processes queued before it in a round robin. Caller
+// holds rq->lock.
+static int
+rqmayhandoff(struct runq *rq, struct proc *p)
+{
+#ifdef MLFQ_SCHED
+  int lev;
+#endif
+
+  if(p->ph == &rq->rt)
+    return rq->rt.p[0] == p;
+  if(rq->rt.n > 0)
+    return 0;
+#ifdef MLFQ_SCHED
+  if(p->pq == &rq->sys)
+    return rq->sys.head == p;
+  if(rq->sys.head || rq->epoch != boostepoch || p->pq == &rq->expired)
+    return 0;
+  for(lev = 0; lev < p->queue; lev++)
+    if(rq->level[lev].head)
+      return 0;
+  return p->pq->head == p && p->ticks <= mlfq.quantum[p->queue];
+#elif MULTILEVEL_SCHED
+  if(p->pq != 0)
+    return rq->even.head == p;
+  return rq->even.head == 0 && rq->odd.p[0] == p;
+#elif STRIDE_SCHED
+  return rq->stride.p[0] == p;
+#else
+  return rq->q.head == p;
+#endif
+}
+
+// Take the first process c may run off rq, another cpu's
+// queue. Those pinned away from c are picked past and put
+// back. Caller holds rq->lock.
+static struct proc*
+rqsteal(struct runq *rq, struct cpu *c)
+{
+  struct proc *p, *skipped, *last, *next;
+#ifdef STRIDE_SCHED
+  uint vpass = rq->vpass;
+#endif
+
+  p = skipped = last = 0;
+  while(rq->nallow[c - cpus] > 0){
+    if((p = rqpick(rq)) == 0 || (p->affinity & CPUBIT(c)))
+      break;
+    p->qnext = 0;
+    if(last)
+      last->qnext = p;
+    else
+      skipped = p;
+    last = p;
+    p = 0;
+  }
+#ifdef STRIDE_SCHED
+  rq->vpass = vpass;
+#endif
+  for(; skipped; skipped = next){
+    next = skipped->qnext;
+    rqadd(rq, skipped);
+  }
+  return p;
+}
+
+// Next process for c to run: from its own run queue,
+// else stolen from the other queue with the most that c
+// may run. 0 if none.
+static struct proc*
+nextproc(struct cpu *c)
+{
+  struct cpu *v, *busiest;
+  struct proc *p;
+  int me;
+
+  acquire(&c->rq.lock);
+  p = rqpick(&c->rq);
+  release(&c->rq.lock);
+  if(p)
+    return p;
+
+  // nallow is read without the lock; a stale count only
+  // means stealing from a less busy queue or not at all.
+  me = c - cpus;
+  busiest = 0;
+  for(v = cpus; v < cpus+ncpu; v++){
+    if(v == c || v->rq.nallow[me] == 0)
+      continue;
+    if(busiest == 0 || v->rq.nallow[me] > busiest->rq.nallow[me])
+      busiest = v;
+  }
+  if(busiest == 0)
+    return 0;
+  acquire(&busiest->rq.lock);
+  p = rqsteal(&busiest->rq, c);
+  release(&busiest->rq.lock);
+  return p;
+}
+
+// Nothing to run: halt until the next interrupt, either
+// a timer tick or the IRQ_WAKEUP that makerunnable() sends.
+// halted is published before the queues are checked again,
+// and makerunnable() queues before it looks at halted, so
+// one of the two always sees the other. Only work c may
+// run counts; a queue of processes pinned elsewhere would
+// otherwise keep it spinning.
+static void
+idle(struct cpu *c)
+{
+  struct cpu *v;
+
+  cli();
+  xchg(&c->halted, 1);
+  __sync_synchronize();
+  for(v = cpus; v < cpus+ncpu; v++)
+    if(v->rq.nallow[c - cpus] > 0)
+      break;
+  if(v == cpus+ncpu)
+    stihlt();
+  c->halted = 0;
+}
+
+// The cpu p should be queued on. The one it last ran on,
+// where its cache and TLB may still be warm, unless that
+// one is busier than this one; then this one. Either way
+// only a cpu in p->affinity.
+static struct cpu*
+placecpu(struct proc *p)
+{
+  struct cpu *c, *me;
+
+  me = mycpu();
+  if(p->last_cpu >= 0 && p->last_cpu < ncpu){
+    c = &cpus[p->last_cpu];
+    if((p->affinity & CPUBIT(c)) &&
+       (c->rq.nrun <= me->rq.nrun || !(p->affinity & CPUBIT(me))))
+      return c;
+  }
+  if(p->affinity & CPUBIT(me))
+    return me;
+  for(c = cpus; c < cpus+ncpu; c++)
+    if(p->affinity & CPUBIT(c))
+      return c;
+  panic("placecpu");
+}
+
+// Mark p RUNNABLE and queue it on the cpu placecpu()
+// chooses. If that is another cpu and it is halted, wake
+// it; if it is this one, wake some halted cpu p may run
+// on, if any, so it can steal the work. Caller must hold
+// p->lock.
+static void
+makerunnable(struct proc *p)
+{
+  struct runq *rq;
+  struct cpu *c, *me, *to;
+
+  p->state = RUNNABLE;
+  p->readytsc = rdtsc();
+  p->readyticks = ticks;
+  me = mycpu();
+  to = placecpu(p);
+  rq = &to->rq;
+  acquire(&rq->lock);
+  rqadd(rq, p);
+  release(&rq->lock);
+
+  if(to != me){
+    if(to->halted)
+      lapicipi(to->apicid, T_IRQ0 + IRQ_WAKEUP);
+    return;
+  }
+  for(c = cpus; c < cpus+ncpu; c++){
+    if(c != me && c->halted && (p->affinity & CPUBIT(c))){
+      lapicipi(c->apicid, T_IRQ0 + IRQ_WAKEUP);
+      break;
+    }
+  }
+}
+
+// makerunnable() for p just woken by the process running
+// here. If nothing else waits on this cpu, queue p here
+// rather than where it last ran: the waker is likely to
+// block soon and hand p this cpu (handofftarget()) with
+// what it just wrote still in the cache, so no halted cpu
+// is woken to steal p meanwhile. Wakeups from interrupt
+// handlers are placed as usual. Caller must hold p->lock.
+static void
+wakerunnable(struct proc *p)
+{
+  struct cpu *me;
+  struct runq *rq;
+
+  me = mycpu();
+  rq = &me->rq;
+  // nrun is read without the lock; it is only a hint.
+  if(me->proc == 0 || me->intr || !(p->affinity & CPUBIT(me)) || rq->nrun > 0){
+    makerunnable(p);
+    return;
+  }
+  p->state = RUNNABLE;
+  p->readytsc = rdtsc();
+  p->readyticks = ticks;
+  acquire(&rq->lock);
+  rqadd(rq, p);
+  release(&rq->lock);
+}
+
 //PAGEBREAK: 32
 // Look in the process table for an UNUSED proc.
 // If found, change state to EMBRYO and initialize
@@ -93,34 +1039,82 @@ allocproc(void)
 
   acquire(&ptable.lock);
 
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == UNUSED)
-      goto found;
-
-  release(&ptable.lock);
-  return 0;
-
-found:
+  if(ptable.nproc >= ptable.maxproc ||
+     (ptable.free == 0 && procgrow() < 0)){
+    release(&ptable.lock);
+    return 0;
+  }
+  p = ptable.free;
+  ptable.free = p->hnext;
+  ptable.nproc++;
   p->state = EMBRYO;
   p->pid = nextpid++;
+  p->hnext = *pidchain(p->pid);
+  *pidchain(p->pid) = p;
   /* init */
   p->queue = 0;
   p->priority = 0;
+#ifdef STRIDE_SCHED
+  p->pass = 0;  // raised to the queue's vpass when first queued
+  p->stride = stridefor(0);
+#endif
   p->lastqueue = 0;
+  p->epoch = boostepoch;
+  p->last_cpu = -1;
+  p->affinity = ~0;  // fork, spawn and clone copy the creator's
+  p->rtruntime = 0;  // not real-time until setrealtime() admits it
+  p->rtperiod = 0;
+  p->rtdeadline = 0;
+  p->rtused = 0;
+  p->rtthrottled = 0;
+  p->rtutil = 0;
+  p->onthrottled = 0;
+  p->thnext = 0;
+  p->thprev = 0;
   p->ppid = 1;
   p->mode = 0;
   p->limit = 0;
+  // Join the creator's memory group (fork, spawn, clone);
+  // its kstack below is charged there too.
+  p->memcg = myproc() ? myproc()->memcg : 0;
+  memcgjoin(p->memcg, 1);
   p->shared_memory = 0;
   p->stack_count = 1;
-  acquire(&tickslock);
-  p->ticks = ticks;
-  release(&tickslock);
+  p->stackbase = 0;
+  p->stacktop = 0;
+  p->nfreestack = 0;
+  p->children = 0;
+  p->zombies = 0;
+  p->sibnext = 0;
+  p->sibprev = 0;
+  p->leader = p;
+  p->threads = 0;
+  p->futexspace = 0;
+  p->futexkey = 0;
+  p->fnext = 0;
+  p->sq = 0;
+  p->snext = 0;
+  p->sprev = 0;
+  p->ontimer = 0;
+  p->tnext = 0;
+  p->tprev = 0;
+  p->ticks = 0;
+  p->runticks = 0;
+  p->runcycles = 0;
+  p->waitticks = 0;
+  p->waitcycles = 0;
+  p->readytsc = 0;
+  p->readyticks = 0;
+  p->nvcsw = 0;
+  p->nivcsw = 0;
 
   release(&ptable.lock);
 
   // Allocate kernel stack.
   if((p->kstack = kalloc()) == 0){
-    p->state = UNUSED;
+    acquire(&ptable.lock);
+    freeproc(p);
+    release(&ptable.lock);
     return 0;
   }
   sp = p->kstack + KSTACKSIZE;
@@ -160,6 +1154,13 @@ userinit(void)
 	  cprintf("argstr error!\n");
 
 */
+  // All of memory is free by now (kinit2()); size the
+  // process table to it.
+  ptable.maxproc = kfreepages() / PROCPAGES;
+  if(ptable.maxproc > NPROC)
+    ptable.maxproc = NPROC;
+  cprintf("proc: up to %d processes\n", ptable.maxproc);
+
   p = allocproc();
   
   initproc = p;
@@ -183,11 +1184,11 @@ userinit(void)
   // run this process. the acquire forces the above
   // writes to be visible, and the lock is also needed
   // because the assignment might not be atomic.
-  acquire(&ptable.lock);
+  acquire(&p->lock);
 
-  p->state = RUNNABLE;
+  makerunnable(p);
 
-  release(&ptable.lock);
+  release(&p->lock);
 }
 
 // Grow current process's memory by n bytes.
@@ -197,21 +1198,32 @@ growproc(int n)
 {
   uint sz;
   struct proc *curproc = myproc();
-  sz = curproc->sz;
+  struct proc *leader = curproc->leader;
+
+  acquire(&ptable.lock);
+  sz = leader->sz;
 
-  if(curproc->limit < sz+n && curproc->limit !=0)
-	  return -1;
+  if(leader->limit < sz+n && leader->limit !=0)
+	  goto bad;
 
   if(n > 0){
-    if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
-      return -1;
+    // Only reserve the range; lazyfault() maps pages as they
+    // are first touched.
+    if(sz + n < sz || sz + n >= KERNBASE)
+      goto bad;
+    sz += n;
   } else if(n < 0){
-    if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
-      return -1;
+    if((sz = shrinkuvm(leader->pgdir, sz, sz + n)) == 0)
+      goto bad;
   }
-  curproc->sz = sz;
+  setgroupsz(leader, sz);
+  release(&ptable.lock);
   switchuvm(curproc);
   return 0;
+
+bad:
+  release(&ptable.lock);
+  return -1;
 }
 
 // Create a new process copying p as the parent.
@@ -223,57 +1235,403 @@ fork(void)
   int i, pid;
   struct proc *np;
   struct proc *curproc = myproc();
-  char *va;
 
   // Allocate process.
   if((np = allocproc()) == 0){
     return -1;
   }
 
-  // Copy process state from proc.
-  if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
+  // Copy process state from proc. The pages are shared
+  // copy-on-write; our own entries just lost PTE_W.
+  np->pgdir = copyuvm(curproc->pgdir, curproc->sz);
+  if(np->pgdir == 0){
     goto bad;
   }
 
 
-  if((va = kalloc()) == 0){
-	goto bad;	  
-  }
-  np->shared_memory = va; 
-
-
-  np->sz = curproc->sz;
-  np->parent = curproc;
+  np->sz = curproc->leader->sz;
+  np->stack_count = curproc->stack_count;
+  np->stackbase = curproc->stackbase;
+  np->stacktop = curproc->stacktop;
+  // The copy has the same holes where threads' stacks were.
+  memmove(np->freestack, curproc->leader->freestack, sizeof(np->freestack));
+  np->nfreestack = curproc->leader->nfreestack;
   *np->tf = *curproc->tf;
 
   // Clear %eax so that fork returns 0 in the child.
   np->tf->eax = 0;
 
   for(i = 0; i < NOFILE; i++)
-    if(curproc->ofile[i])
-      np->ofile[i] = filedup(curproc->ofile[i]);
-  np->cwd = idup(curproc->cwd);
+    if(curproc->leader->ofile[i])
+      np->ofile[i] = filedup(curproc->leader->ofile[i]);
+  np->cwd = idup(curproc->leader->cwd);
 
   safestrcpy(np->name, curproc->name, sizeof(curproc->name));
 
   pid = np->pid;
-  np->ppid = np->parent->pid;
 
+  // The child belongs to the process, not just this thread.
   acquire(&ptable.lock);
+  setparent(np, curproc->leader);
+  release(&ptable.lock);
 
-  np->state = RUNNABLE;
+  np->affinity = curproc->affinity;
 
-  release(&ptable.lock);
+  acquire(&np->lock);
+  makerunnable(np);
+  release(&np->lock);
 
   return pid;
 
 bad:
 	kfree(np->kstack);
 	np->kstack = 0;
-	np->state = UNUSED;
+	acquire(&ptable.lock);
+	freeproc(np);
+	release(&ptable.lock);
 	return -1;
 }
 
+// Create a new process running the program at path, without
+// copying the caller's memory: the image is loaded straight from
+// the ELF, as exec would.  stacksize 0 gives exec's one-page
+// stack; otherwise it is exec2's and the caller must be an
+// administrator.  The child gets the caller's open files, with
+// act applied in order.  Return the child's pid, or -1.
+int
+spawn(char *path, char **argv, int stacksize, struct spawnfd *act)
+{
+  int i, pid, detach;
+  struct proc *np;
+  struct proc *curproc = myproc();
+  struct file *f;
+
+  if(stacksize != 0 && (!curproc->mode || stacksize < 1 || 100 < stacksize))
+    return -1;
+
+  if((np = allocproc()) == 0)
+    return -1;
+
+  memset(np->tf, 0, sizeof(*np->tf));
+  if(loadimage(path, argv, stacksize ? stacksize : 1,
+               &np->pgdir, &np->sz, &np->tf->esp, &np->tf->eip) < 0){
+    np->pgdir = 0;
+    goto bad;
+  }
+  np->tf->cs = (SEG_UCODE << 3) | DPL_USER;
+  np->tf->ds = (SEG_UDATA << 3) | DPL_USER;
+  np->tf->es = np->tf->ds;
+  np->tf->ss = np->tf->ds;
+  np->tf->eflags = FL_IF;
+  np->stack_count = 1;
+  np->stacktop = np->sz;
+  np->stackbase = np->sz - (stacksize ? stacksize : 1)*PGSIZE;
+
+  for(i = 0; i < NOFILE; i++)
+    if(curproc->leader->ofile[i])
+      np->ofile[i] = filedup(curproc->leader->ofile[i]);
+  detach = 0;
+  for(; act && act->op != SPAWN_END; act++){
+    switch(act->op){
+    case SPAWN_DUP2:
+      if(act->fd < 0 || act->fd >= NOFILE || act->newfd < 0 ||
+         act->newfd >= NOFILE || (f = np->ofile[act->fd]) == 0)
+        goto badfiles;
+      if(act->fd == act->newfd)
+        break;
+      if(np->ofile[act->newfd])
+        fileclose(np->ofile[act->newfd]);
+      np->ofile[act->newfd] = filedup(f);
+      break;
+    case SPAWN_CLOSE:
+      if(act->fd < 0 || act->fd >= NOFILE || np->ofile[act->fd] == 0)
+        goto badfiles;
+      fileclose(np->ofile[act->fd]);
+      np->ofile[act->fd] = 0;
+      break;
+    case SPAWN_DETACH:
+      detach = 1;
+      break;
+    default:
+      goto badfiles;
+    }
+  }
+  np->cwd = idup(curproc->leader->cwd);
+
+  safestrcpy(np->name, progname(path), sizeof(np->name));
+
+  pid = np->pid;
+
+  acquire(&ptable.lock);
+  setparent(np, detach ? initproc : curproc->leader);
+  release(&ptable.lock);
+
+  np->affinity = curproc->affinity;
+
+  acquire(&np->lock);
+  makerunnable(np);
+  release(&np->lock);
+
+  return pid;
+
+badfiles:
+  for(i = 0; i < NOFILE; i++)
+    if(np->ofile[i]){
+      fileclose(np->ofile[i]);
+      np->ofile[i] = 0;
+    }
+  freevm(np->pgdir);
+bad:
+  kfree(np->kstack);
+  np->kstack = 0;
+  acquire(&ptable.lock);
+  freeproc(np);
+  release(&ptable.lock);
+  return -1;
+}
+
+//PAGEBREAK: 40
+// Threads.  A thread is a proc sharing its leader's pgdir and
+// sz; ofile, cwd, children and the memory limit are only kept
+// in the leader.  Each thread has its own kernel stack and its
+// own user stack, reserved like exec2's (guard page below,
+// pages mapped as they are touched).  Threads are scheduled
+// individually, like forked children.  kill() of any thread
+// and exit() from any thread end the whole process; exec()
+// is for the leader only, and ends the other threads first.
+
+static void
+killproc(struct proc *p)
+{
+  acquire(&p->lock);
+  p->killed = 1;
+  // Wake process from sleep if necessary.
+  if(p->state == SLEEPING)
+    makerunnable(p);
+  release(&p->lock);
+}
+
+// Kill every thread of leader's process.
+// Caller holds ptable.lock.
+static void
+killgroup(struct proc *leader)
+{
+  struct proc *t;
+
+  killproc(leader);
+  for(t = leader->threads; t; t = t->sibnext)
+    killproc(t);
+}
+
+// Free an exited thread t and its user stack.
+// Caller holds ptable.lock.
+static void
+reapthread(struct proc *t)
+{
+  struct proc *leader = t->leader;
+
+  kidunlink(&leader->threads, t);
+  acquire(&t->lock);
+  kfree(t->kstack);
+  t->kstack = 0;
+  shrinkuvm(t->pgdir, t->stacktop, t->stackbase - PGSIZE);
+  // Remember the hole for the next clone(); if there is no
+  // room it simply stays unused.
+  if(leader->nfreestack < NFREESTACK){
+    leader->freestack[leader->nfreestack].base = t->stackbase - PGSIZE;
+    leader->freestack[leader->nfreestack].top = t->stacktop;
+    leader->nfreestack++;
+  }
+  t->pgdir = 0;
+  t->leader = t;
+  t->name[0] = 0;
+  t->killed = 0;
+  freeproc(t);
+  release(&t->lock);
+}
+
+// Kill and reap the leader's other threads.  Caller is the
+// leader and holds ptable.lock.
+static void
+endthreads(struct proc *leader)
+{
+  struct proc *t, *next;
+
+  for(t = leader->threads; t; t = t->sibnext)
+    killproc(t);
+  for(;;){
+    for(t = leader->threads; t; t = next){
+      next = t->sibnext;
+      if(t->state == ZOMBIE)
+        reapthread(t);
+    }
+    if(leader->threads == 0)
+      return;
+    sleep(leader, &ptable.lock);
+  }
+}
+
+// Leave the caller as its process's only thread, for exec.
+int
+stopthreads(void)
+{
+  struct proc *curproc = myproc();
+
+  if(curproc->leader != curproc)
+    return -1;
+  acquire(&ptable.lock);
+  endthreads(curproc);
+  release(&ptable.lock);
+  return 0;
+}
+
+// Start a thread in the caller's process at start, with fn and
+// arg as its two arguments, on a new stack of stackpages pages.
+// Return its pid (which is its thread id), or -1.
+int
+clone(uint start, uint fn, uint arg, int stackpages)
+{
+  struct proc *np;
+  struct proc *curproc = myproc();
+  struct proc *leader = curproc->leader;
+  uint base, top, need, ustack[3];
+  int i;
+
+  if(stackpages < 1 || 100 < stackpages)
+    return -1;
+  if((np = allocproc()) == 0)
+    return -1;
+
+  acquire(&ptable.lock);
+  // Reuse a reaped thread's stack if one is big enough (first
+  // fit), so a process that keeps making and joining threads
+  // does not grow without bound; otherwise go above the heap.
+  need = (stackpages + 1)*PGSIZE;
+  for(i = 0; i < leader->nfreestack; i++)
+    if(leader->freestack[i].top <= leader->sz &&
+       leader->freestack[i].top - leader->freestack[i].base >= need)
+      break;
+  base = i < leader->nfreestack ? leader->freestack[i].base : PGROUNDUP(leader->sz);
+  top = base + need;
+  if(top >= KERNBASE || (leader->limit != 0 && leader->limit < top))
+    goto bad;
+  // A reused range lies below sz, where the other threads can
+  // fault pages in at any time: drop whatever they touched
+  // since the reap, and map through lazyfault(), which
+  // tolerates a page that is already there.
+  if(i < leader->nfreestack)
+    shrinkuvm(leader->pgdir, top, base);
+  if(lazyfault(leader->pgdir, base, top, 1) < 0)
+    goto bad;
+  clearpteu(leader->pgdir, (char*)base);
+  if(lazyfault(leader->pgdir, top - PGSIZE, top, 1) < 0){
+    shrinkuvm(leader->pgdir, base + PGSIZE, base);
+    goto bad;
+  }
+
+  ustack[0] = 0xffffffff;  // fake return PC
+  ustack[1] = fn;
+  ustack[2] = arg;
+  copyout(leader->pgdir, top - sizeof(ustack), ustack, sizeof(ustack));
+  if(i < leader->nfreestack){
+    leader->freestack[i].base = top;
+    if(leader->freestack[i].base == leader->freestack[i].top)
+      leader->freestack[i] = leader->freestack[--leader->nfreestack];
+  }
+
+  np->pgdir = leader->pgdir;
+  np->leader = leader;
+  kidlink(&leader->threads, np);
+  setgroupsz(leader, top > leader->sz ? top : leader->sz);
+  np->ppid = leader->pid;
+  release(&ptable.lock);
+
+  np->stackbase = base + PGSIZE;
+  np->stacktop = top;
+  np->stack_count = 1;
+  *np->tf = *curproc->tf;
+  np->tf->eip = start;
+  np->tf->esp = top - sizeof(ustack);
+  safestrcpy(np->name, curproc->name, sizeof(np->name));
+  np->affinity = curproc->affinity;
+
+  acquire(&np->lock);
+  makerunnable(np);
+  release(&np->lock);
+
+  return np->pid;
+
+bad:
+  release(&ptable.lock);
+  kfree(np->kstack);
+  np->kstack = 0;
+  acquire(&ptable.lock);
+  freeproc(np);
+  release(&ptable.lock);
+  return -1;
+}
+
+// End the calling thread; thread_join() collects retval.
+// In the leader this is exit().
+void
+thread_exit(void *retval)
+{
+  struct proc *curproc = myproc();
+
+  if(curproc->leader == curproc)
+    exit();
+
+  acquire(&ptable.lock);
+  rtload -= curproc->rtutil;
+  curproc->rtutil = 0;
+  curproc->rtruntime = 0;
+  curproc->rtperiod = 0;
+  curproc->retval = retval;
+
+  // The leader (exit, exec) or a joiner may be waiting.
+  wakeup(curproc->leader);
+
+  acquire(&curproc->lock);
+  curproc->state = ZOMBIE;
+  release(&ptable.lock);
+  sched();
+  panic("zombie thread_exit");
+}
+
+// Wait for thread tid of the caller's process to exit, free it
+// and store its thread_exit() value in *retval.
+int
+thread_join(int tid, void **retval)
+{
+  struct proc *t;
+  struct proc *curproc = myproc();
+  void *rv;
+
+  acquire(&ptable.lock);
+  for(;;){
+    t = findproc(tid);
+    if(t == 0 || t == curproc || t == t->leader || t->leader != curproc->leader){
+      release(&ptable.lock);
+      return -1;
+    }
+    if(t->state == ZOMBIE){
+      rv = t->retval;
+      reapthread(t);
+      release(&ptable.lock);
+      // Another thread may have shrunk the heap since argptr()
+      // checked retval, so store through copyout().
+      if(retval && copyout(curproc->pgdir, (uint)retval, &rv, sizeof(rv)) < 0)
+        return -1;
+      return 0;
+    }
+    if(curproc->killed){
+      release(&ptable.lock);
+      return -1;
+    }
+    sleep(curproc->leader, &ptable.lock);
+  }
+}
+
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait() to find out it exited.
@@ -288,6 +1646,18 @@ exit(void)
   if(curproc == initproc)
     panic("init exiting");
 
+  // A thread takes its whole process down; the leader, once
+  // killed, comes back here and reaps it.
+  if(curproc->leader != curproc){
+    acquire(&ptable.lock);
+    killgroup(curproc->leader);
+    release(&ptable.lock);
+    thread_exit(0);
+  }
+  acquire(&ptable.lock);
+  endthreads(curproc);
+  release(&ptable.lock);
+
   // Close all open files.
   for(fd = 0; fd < NOFILE; fd++){
     if(curproc->ofile[fd]){
@@ -306,12 +1676,10 @@ exit(void)
   pde_t *pgdir;
   pde_t *pte;
 
-  va= curproc->shared_memory;
-
-  if(va == 0)
-	  goto skip_free_shared_memory;
   acquire(&ptable.lock);
-  for(p = ptable.proc; p< &ptable.proc[NPROC]; p++){
+  va = curproc->shared_memory;
+  curproc->shared_memory = 0;
+  for(p = ptable.all; va && p; p = p->allnext){
 	  if(p->pid != 0 && p->shared_memory !=0 && p->pgdir != 0 && p->pid != curproc->pid){
 		  pgdir = p->pgdir;
 		  pde = &pgdir[PDX(va)];
@@ -326,25 +1694,36 @@ exit(void)
 	  }
   }
   release(&ptable.lock);
-  kfree(va);
+  if(va)
+	  kfree(va);
 
-skip_free_shared_memory:
   acquire(&ptable.lock);
 
+  // Give back its real-time share.
+  rtload -= curproc->rtutil;
+  curproc->rtutil = 0;
+  curproc->rtruntime = 0;
+  curproc->rtperiod = 0;
+
   // Parent might be sleeping in wait().
-  wakeup1(curproc->parent);
+  wakeup(curproc->parent);
 
   // Pass abandoned children to init.
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-    if(p->parent == curproc){
-      p->parent = initproc;
-      if(p->state == ZOMBIE)
-        wakeup1(initproc);
-    }
-  }
+  kidsplice(&initproc->children, &curproc->children, initproc);
+  if(kidsplice(&initproc->zombies, &curproc->zombies, initproc))
+    wakeup(initproc);
+
+  // Move to the parent's list of children to reap.
+  kidunlink(&curproc->parent->children, curproc);
+  kidlink(&curproc->parent->zombies, curproc);
 
   // Jump into the scheduler, never to return.
+  // Our parent can look at us once ptable.lock is
+  // released, but cannot reap us before the scheduler
+  // drops p->lock behind our final swtch.
+  acquire(&curproc->lock);
   curproc->state = ZOMBIE;
+  release(&ptable.lock);
   sched();
   panic("zombie exit");
 }
@@ -355,123 +1734,63 @@ int
 wait(void)
 {
   struct proc *p;
-  int havekids, pid;
-  struct proc *curproc = myproc();
+  int pid;
+  struct proc *curproc = myproc()->leader;
   
   acquire(&ptable.lock);
   for(;;){
-    // Scan through table looking for exited children.
-    havekids = 0;
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->parent != curproc)
-        continue;
-      havekids = 1;
-      if(p->state == ZOMBIE){
-        // Found one.
-        pid = p->pid;
-        kfree(p->kstack);
-        p->kstack = 0;
-        freevm(p->pgdir);
-        p->pid = 0;
-        p->parent = 0;
-        p->name[0] = 0;
-        p->killed = 0;
-        p->state = UNUSED;
-        release(&ptable.lock);
-        return pid;
-      }
+    // Any exited children?  exit() put them on our zombie
+    // list; p->lock is held until p's final swtch is done.
+    if((p = curproc->zombies) != 0){
+      kidunlink(&curproc->zombies, p);
+      acquire(&p->lock);
+      pid = p->pid;
+      kfree(p->kstack);
+      p->kstack = 0;
+      freevm(p->pgdir);
+      p->parent = 0;
+      p->name[0] = 0;
+      p->killed = 0;
+      freeproc(p);
+      release(&p->lock);
+      release(&ptable.lock);
+      return pid;
     }
 
     // No point waiting if we don't have any children.
-    if(!havekids || curproc->killed){
+    if(curproc->children == 0 || myproc()->killed){
       release(&ptable.lock);
       return -1;
     }
 
-    // Wait for children to exit.  (See wakeup1 call in proc_exit.)
+    // Wait for children to exit.  (See wakeup call in proc_exit.)
     sleep(curproc, &ptable.lock);  //DOC: wait-sleep
   }
 }
 
 
-//-----------------------------------------------------------------------
-// check whether even numbers exist
-// if table has even numbers pid, it returns 1
-// else it returns 0
-int
-even_exist(void)
-{
-	struct proc *p;
-	int count = 0;
-	for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-		if((p->pid) % 2 == 0 && p->state == RUNNABLE && (p->pid) != 2){
-			count++;
-		}
-	}
-	if(count == 0)
-		return 0;
-	return 1;
-}
-
-
-
-// to find minimum odd pid
-// it is used in scheduler() to compose FCFS scheduler
-struct proc*
-min_odd_pid(void)
-{
-	struct proc *p;
-	struct proc *return_p = ptable.proc;
-	int min = 9999999;
-	for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-		if((p->pid) < min && (p->pid) > 2 && (p->pid)%2 == 1 && p->state == RUNNABLE){
-			// pid 1 and 2 is running before program start. therefore pid should be bigger than 2
-			min = p -> pid;
-			return_p = p;
-		}
-	}
-	return return_p;
-}
-
-// to check queue is empty or not
-int
-check_queuenum()
+// p is about to run: add the time since it became
+// RUNNABLE to its wait time. Caller holds p->lock.
+// rdtsc() is only 32 bits wide and wraps within a few
+// seconds, so a long wait is counted in whole ticks.
+static void
+chargewait(struct proc *p)
 {
-	struct proc *p;
-	int count = 0;
-	int highest = 8;
-	for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-		if((p->queue) < highest && p->state == RUNNABLE && p->pid != 1 && p->pid !=2 && p->lastqueue== 0){
-			highest = p->queue;
-			count++;
-		}
-	}
-	if(count == 0)
-		return -1;
-	return highest;
-}
+  uint n, waited;
 
-// return proc* which has the highest priority
-struct proc*
-select_p(int num)
-{
-	struct proc *p;
-	struct proc *return_p=0;
-	int max = -2;
-
-	for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-		if((p->priority) >= max && (p->state) == RUNNABLE && (p->queue) == num 
-			&& !(p->lastqueue) && p->pid != 1 && p->pid !=2){
-				max = p->priority;
-				return_p = p;
-		}
-	}
-	return return_p;
-	
+  waited = ticks - p->readyticks;
+  if(tsc_per_tick == 0 || waited + 2 >= 0xffffffff / tsc_per_tick){
+    p->waitticks += waited;
+    return;
+  }
+  p->waitcycles += rdtsc() - p->readytsc;
+  if(tsc_per_tick){
+    n = p->waitcycles / tsc_per_tick;
+    p->waitcycles -= n * tsc_per_tick;
+    p->waitticks += n;
+  }
 }
 
-
-
 //PAGEBREAK: 42
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
@@ -483,156 +1802,123 @@ select_p(int num)
 void
 scheduler(void)
 {
+  struct proc *p;
+  struct cpu *c = mycpu();
+  c->proc = 0;
 
-#ifdef MULTILEVEL_SCHED
-	struct proc *p;
-  	struct cpu *c = mycpu();
-  	struct proc *choice = ptable.proc;
-  	c->proc = 0;
-  	int check = 0;
-  	for(;;){
-    	// Enable interrupts on this processor.
-    	sti();
-    	// Loop over process table looking for process to run.
-    
-	
-		acquire(&ptable.lock);
-		check = even_exist();
-    	for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-	  		choice = p;// default
-			if(p-> state != RUNNABLE)
-				continue;
-	 
-	  		// check == 1 means, there are even numbers in ptable
-	  		// using RR
-	  		if(p->pid == 1 || p->pid ==2){
-				choice = p;
-	  		}
-	  		else if(check){
-		 	// there are even number in ptable but this time is odd number  
-		 		if((p->pid) %2 != 0)
-			 		continue;
-			 	choice = p;
-	  		}		 
-
-
-	  		// check == 0 means, there are only odd numbers in ptable
-	  		// using FCFS
-	  		// process which has minimum pid came earlier than otehrs
-	  		else
-				choice = min_odd_pid();
+  for(;;){
+    // Enable interrupts on this processor.
+    sti();
 
-    
-	  		// Switch to chosen process.  It is the process's job
-      		// to release ptable.lock and then reacquire it
-      		// before jumping back to us.
-	  		c->proc = choice;
-      		switchuvm(choice);// load process
-      		choice->state = RUNNING;
-
-      		swtch(&(c->scheduler), choice->context);
-      		switchkvm();// kernel load its memory
-
-      		// Process is done running for now.
-      		// It should have changed its p->state before coming back.
-      		c->proc = 0;
-	  	}
-		release(&ptable.lock);
-	}
-#elif MLFQ_SCHED
-	struct proc *p;
-	struct proc *tmp=0;
-	struct proc *choice=0;
-	struct cpu *c = mycpu();
-	
-	c->proc = 0;
-	for(;;){
-		sti();
-
-		acquire(&ptable.lock);
-		
-		for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-			if(p->state != RUNNABLE)
-				continue;
-			int num=0;
-			if(p-> pid == 1 || p->pid ==2){
-				choice = p;
-			}
+    // Policy lives in rqpick(); no table scan, no ptable.lock.
+    if((p = nextproc(c)) == 0){
+      idle(c);
+      continue;
+    }
 
-			else{ 
-				// find the highest level queue which contain RUNNABLE
-				num = check_queuenum();
-						
-				// there's nothing in queues
-				if(num == -1)
-					priority_boosting_nolock();
-				// if something is in the queue
-				else{
-					// return the highest priority process in the queue
-					tmp = select_p(num); 
-					if(tmp -> ticks > ((2*num)+4)){ // tmp used in the last and over the time quantum
-						if(num != MLFQ_K){ // it is not last queue
-							tmp->queue = num+1; // go to below queue
-							tmp->ticks = 0;
-						}
-						else
-							tmp->lastqueue = 1; // it's finished. wait boosting
-						continue;
-					}
-					
-					else{ // ramains time quantum
-						choice = tmp;
-					}
-				}
+    // Switch to chosen process.  It is the process's job
+    // to release p->lock and then reacquire it
+    // before jumping back to us.
+    acquire(&p->lock);
+    if(p->state == RUNNABLE){
+      c->proc = p;
+      chargewait(p);
+      switchuvm(p);// load process
+      p->state = RUNNING;
+      p->last_cpu = c - cpus;
+
+      c->tscstamp = rdtsc();
+      swtch(&(c->scheduler), p->context);
+      // p may have handed the cpu on; what came back is c->proc.
+      p = c->proc;
+      chargetime();
+      switchkvm();// kernel load its memory
+
+      // Process is done running for now.
+      // It should have changed its p->state before coming back.
+      c->proc = 0;
+    }
+    release(&p->lock);
+  }
+}
 
-			}
-			c->proc = choice;
-      		switchuvm(choice);
-      		choice->state = RUNNING;
 
-      		swtch(&(c->scheduler), choice->context);
-      		switchkvm();
-			c->proc = 0;
-		}
-		release(&ptable.lock);
-	}
 
-#else  // original scheduling
-	struct proc *p;
-  	struct cpu *c = mycpu();
-	c->proc = 0;
-	
-  	for(;;){
-    	// Enable interrupts on this processor.
-    	sti();
-
-    	// Loop over process table looking for process to run.
-    	acquire(&ptable.lock);
-    	for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-			if(p->state != RUNNABLE)
-				continue;
-      		// Switch to chosen process.  It is the process's job
-      		// to release ptable.lock and then reacquire it
-      		// before jumping back to us.
-	  		c->proc = p;
-      		switchuvm(p);// load process
-      		p->state = RUNNING;
-
-      		swtch(&(c->scheduler), p->context);
-      		switchkvm();// kernel load its memory
-
-      		// Process is done running for now.
-      		// It should have changed its p->state before coming back.
-      		c->proc = 0;
-	 	} 
-    	release(&ptable.lock);
-  	}
+// Charge the process running on this cpu for the cycles
+// since the cpu last stamped it, in whole ticks: p->ticks
+// toward its MLFQ quantum and p->runticks in all.  Called
+// on every swtch in and out and on every timer interrupt,
+// so no single charge comes near 2^32 cycles.
+// Interrupts must be off.
+void
+chargetime(void)
+{
+  struct cpu *c = mycpu();
+  struct proc *p = c->proc;
+  uint now, n;
+
+  now = rdtsc();
+  if(p){
+    p->runcycles += now - c->tscstamp;
+    if(tsc_per_tick){
+      n = p->runcycles / tsc_per_tick;
+      p->runcycles -= n * tsc_per_tick;
+      if(rtactive(p))
+        p->rtused += n; // real-time time is not held against the level
+      else {
+        p->ticks += n;
+#ifdef STRIDE_SCHED
+        p->pass += n * p->stride;
 #endif
+      }
+      p->runticks += n;
+    }
+  }
+  c->tscstamp = now;
+}
+
+// Directed yield. p, about to block, gives this cpu
+// straight to the process it last woke if that one is
+// still queued here and the policy would run it next,
+// skipping the trip through the scheduler thread. The
+// target comes off the run queue before its lock is
+// taken, so no other cpu can be switching to it. Returns
+// the target with its lock held, or 0. Caller holds p->lock.
+static struct proc*
+handofftarget(struct proc *p)
+{
+  struct runq *rq = &mycpu()->rq;
+  struct proc *np;
+
+  if((np = p->woke) == 0)
+    return 0;
+  acquire(&rq->lock);
+  if(np->rq != rq || np->pid != p->wokepid || !rqmayhandoff(rq, np)){
+    release(&rq->lock);
+    return 0;
+  }
+  rqdel(rq, np);
+  release(&rq->lock);
+  acquire(&np->lock);
+  return np;
 }
 
+// Run after swtch() comes back in a process. If the cpu
+// was handed to it by another process rather than by the
+// scheduler, release that one's lock, held across the switch.
+static void
+finishswitch(void)
+{
+  struct cpu *c = mycpu();
+  struct proc *prev;
 
+  if((prev = c->prev) != 0){
+    c->prev = 0;
+    release(&prev->lock);
+  }
+}
 
-// Enter scheduler.  Must hold only ptable.lock
+// Enter scheduler.  Must hold only p->lock
 // and have changed proc->state. Saves and restores
 // intena because intena is a property of this
 // kernel thread, not this CPU. It should
@@ -644,9 +1930,11 @@ sched(void)
 {
   int intena;
   struct proc *p = myproc();
+  struct proc *np;
+  struct cpu *c;
 
-  if(!holding(&ptable.lock))
-    panic("sched ptable.lock");
+  if(!holding(&p->lock))
+    panic("sched p->lock");
   if(mycpu()->ncli != 1)
     panic("sched locks");
   if(p->state == RUNNING)
@@ -654,7 +1942,26 @@ sched(void)
   if(readeflags()&FL_IF)
     panic("sched interruptible");
   intena = mycpu()->intena;
-  swtch(&p->context, mycpu()->scheduler);
+  np = 0;
+  if(p->state != RUNNABLE){ // blocking, not just yielding
+    p->nvcsw++;
+    np = handofftarget(p);
+  } else
+    p->nivcsw++;
+  p->woke = 0;
+  if(np){
+    c = mycpu();
+    chargetime();
+    c->proc = np;
+    chargewait(np);
+    switchuvm(np);
+    np->state = RUNNING;
+    np->last_cpu = c - cpus;
+    c->prev = p;
+    swtch(&p->context, np->context);
+  } else
+    swtch(&p->context, mycpu()->scheduler);
+  finishswitch();
   mycpu()->intena = intena;
 }
 
@@ -676,10 +1983,12 @@ sys_print_hello(void)
 void
 yield(void)
 { 
-  acquire(&ptable.lock);  //DOC: yieldlock
-  myproc()->state = RUNNABLE;
+  struct proc *p = myproc();
+
+  acquire(&p->lock);  //DOC: yieldlock
+  makerunnable(p);
   sched();
-  release(&ptable.lock);
+  release(&p->lock);
 }
 
 
@@ -699,6 +2008,9 @@ getlev(void)
 {
 	int q_lev;
 	struct proc *p = myproc();
+#ifdef MLFQ_SCHED
+	renormalize(p);
+#endif
 	q_lev = p -> queue;
 	return q_lev;
 }
@@ -718,34 +2030,39 @@ setpriority(int pid, int priority)
 {
 	struct proc *p;
 	struct proc *current_p = myproc();
-    int onoff = 1;
-  	 
 
     if(priority < 0 || priority > 10){
         return -2;
     }
-    for(p = ptable.proc; p< &ptable.proc[NPROC]; p++){
-        
-		if(p->pid == pid && p->pid > 0)
-            onoff = 0;
-    }
-	if(onoff)
-		return -1;
-	
-	onoff = 1;
-	for(p = ptable.proc; p< &ptable.proc[NPROC]; p++){
-        
-		if(current_p && p->pid == pid && p->ppid == current_p->pid){
-			onoff = 0;
-			break;
-		}
-    }
-	if(onoff)
+	// only a parent may change its child's priority
+	acquire(&ptable.lock);
+	p = findproc(pid);
+	if(p == 0 || current_p == 0 || p->ppid != current_p->pid){
+		release(&ptable.lock);
 		return -1;
-  
-    acquire(&ptable.lock);
+	}
+    acquire(&p->lock);
+	release(&ptable.lock);
     p->priority = priority;
-    release(&ptable.lock);
+#ifdef STRIDE_SCHED
+	// priority+1 tickets; takes effect from its next tick
+	p->stride = stridefor(priority);
+#endif
+#ifdef MLFQ_SCHED
+	// keep its run queue in priority order
+	struct runq *rq;
+	struct procq *q;
+	if((rq = p->rq) != 0){
+		acquire(&rq->lock);
+		if(p->rq == rq && p->pq){ // not taken off meanwhile, not real-time
+			q = p->pq;
+			qremove(p);
+			qinsert(q, p);
+		}
+		release(&rq->lock);
+	}
+#endif
+    release(&p->lock);
     return 0;
   
 }
@@ -765,55 +2082,107 @@ sys_setpriority(void)
 void
 yield_MLFQ(int queuelevel)
 {
-	acquire(&ptable.lock);
-	myproc()->state = RUNNABLE;
-	myproc()->queue = queuelevel+1;
+	struct proc *p = myproc();
+
+	acquire(&p->lock);
+	__sync_fetch_and_add(&mlfq.demotions[queuelevel], 1);
+	p->queue = queuelevel+1;
+	p->earlysleeps = 0;
+	makerunnable(p);
 	sched();
-	release(&ptable.lock);
+	release(&p->lock);
 	
 }
 
 void
 yield_MLFQ_last_Level(int queuelevel)
 {
+	__sync_fetch_and_add(&mlfq.demotions[queuelevel], 1);
 	myproc()->lastqueue = 1;
+	myproc()->earlysleeps = 0;
 	yield();	
 }
 #ifdef MLFQ_SCHED
 
+// Start a new boost epoch. Nothing is visited here:
+// queues and processes find out through renormalize()
+// the next time the scheduler or the timer looks at them.
 void
 priority_boosting(void)
 {
+	__sync_fetch_and_add(&boostepoch, 1);
+	__sync_fetch_and_add(&mlfq.boosts, 1);
+}
+
+// Read and/or set the MLFQ tunables; admin only.
+// in (if not 0) gives new level count, boost period and
+// quanta; out (if not 0) gets the current ones together
+// with the per-level statistics.
+int
+mlfqctl(struct mlfqinfo *in, struct mlfqinfo *out)
+{
+	struct cpu *c;
 	struct proc *p;
-	acquire(&ptable.lock);
-	for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-		if(p->queue != L0 && p->pid > 0){
-			if(p-> state == RUNNING || p->state == RUNNABLE){
-				p->queue = L0;
-				p->ticks = 0;
-				p->state = RUNNABLE;
-				p->lastqueue = 0;
+	int lev;
+
+	if(!myproc()->mode)
+		return -1;
+
+	if(in){
+		if(in->nlevel < 1 || in->nlevel > NMLFQ || in->boost < 1 ||
+				in->promote < 0)
+			return -1;
+		for(lev = 0; lev < in->nlevel; lev++)
+			if(in->quantum[lev] < 1)
+				return -1;
+		// policypick() reads the tunables under its queue's
+		// lock, so hold every queue's, in cpu order, until the
+		// new ones are in place and nothing is left queued on
+		// a level that went away.
+		for(c = cpus; c < cpus+ncpu; c++)
+			acquire(&c->rq.lock);
+		for(lev = 0; lev < in->nlevel; lev++)
+			mlfq.quantum[lev] = in->quantum[lev];
+		mlfq.boost = in->boost;
+		mlfq.promote = in->promote;
+		if(in->nlevel != mlfq.nlevel){
+			// Fold what is queued on levels going away
+			// into the new last level.
+			mlfq.nlevel = in->nlevel;
+			for(c = cpus; c < cpus+ncpu; c++){
+				for(lev = mlfq.nlevel; lev < NMLFQ; lev++){
+					while((p = c->rq.level[lev].head) != 0){
+						qremove(p);
+						qinsert(mlfqlist(&c->rq, p), p);
+					}
+				}
 			}
-		}		
+		}
+		for(c = cpus; c < cpus+ncpu; c++)
+			release(&c->rq.lock);
 	}
-	release(&ptable.lock);
 
+	if(out){
+		memmove(out, &mlfq, sizeof(*out));
+		for(lev = 0; lev < NMLFQ; lev++)
+			out->nrun[lev] = 0;
+		for(c = cpus; c < cpus+ncpu; c++){
+			acquire(&c->rq.lock);
+			for(lev = 0; lev < NMLFQ; lev++)
+				for(p = c->rq.level[lev].head; p; p = p->qnext)
+					out->nrun[lev]++;
+			release(&c->rq.lock);
+		}
+	}
+	return 0;
 }
-void
-priority_boosting_nolock(void)
+
+#else
+
+int
+mlfqctl(struct mlfqinfo *in, struct mlfqinfo *out)
 {
-	struct proc *p;
-	
-	for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-		if(p->queue != L0 && p->pid > 0){
-			if(p-> state == RUNNING || p->state == RUNNABLE){
-				p->queue = L0;
-				p->ticks = 0;
-				p->state = RUNNABLE;
-				p->lastqueue = 0;
-			}
-		}			
-	}
+	return -1;
 }
 
 #endif
@@ -830,6 +2199,21 @@ getadmin(char *password)
 	return -1;
 }
 
+int
+sys_mlfqctl(void)
+{
+	int uin, uout;
+	char *in = 0, *out = 0;
+
+	if(argint(0, &uin) < 0 || argint(1, &uout) < 0)
+		return -1;
+	if(uin && argptr(0, &in, sizeof(struct mlfqinfo)) < 0)
+		return -1;
+	if(uout && argptr(1, &out, sizeof(struct mlfqinfo)) < 0)
+		return -1;
+	return mlfqctl((struct mlfqinfo*)in, (struct mlfqinfo*)out);
+}
+
 int
 sys_getadmin(void)
 {
@@ -839,32 +2223,24 @@ sys_getadmin(void)
 	return getadmin(password);
 }
 
+// The limit applies to reserved size (sz), as sbrk() grows it.
+// Pages actually resident are charged to the memory group and
+// reported by memcgstat().
 int
 setmemorylimit(int pid, int limit)
 {    
-	int check=1;
     struct proc *p;
     
     if(limit < 0 || !(myproc()->mode))
         return -1;
   acquire(&ptable.lock);
-    for(p = ptable.proc; p< &ptable.proc[NPROC]; p++){
-        if(p->pid == pid){
-            check = 0;
-            if(p->sz >= limit){
-				release(&ptable.lock);
-                return -1;
-			}
-            else{ 
-                p -> limit = limit;
-                break;
-            }
-        }
+    // Threads share one limit, kept in the leader.
+    if((p = findproc(pid)) == 0 || (p = p->leader)->sz >= limit){
+        release(&ptable.lock);
+        return -1;
     }
+    p -> limit = limit;
   release(&ptable.lock);
-  if(check){
-	  return -1;
-  }
   return 0;
 }
 
@@ -879,6 +2255,252 @@ sys_setmemorylimit(void)
     return setmemorylimit(pid,limit);
 }
 
+// Let pid run only on the cpus in mask (bit i for
+// cpus[i]); admin only. A process queued on a cpu it may
+// no longer use moves; a running one moves the next time
+// it is queued.
+int
+setaffinity(int pid, int mask)
+{
+	struct proc *p;
+	struct cpu *c;
+	struct runq *rq;
+	int moved;
+
+	mask &= (1 << ncpu) - 1;
+	if(mask == 0 || !(myproc()->mode))
+		return -1;
+	acquire(&ptable.lock);
+	if((p = findproc(pid)) == 0){
+		release(&ptable.lock);
+		return -1;
+	}
+	acquire(&p->lock);
+	release(&ptable.lock);
+
+	// A queued p's affinity is counted in its queue's
+	// nallow, so it changes under that queue's lock.
+	moved = 0;
+	for(c = cpus; c < cpus+ncpu; c++){
+		if(p->rq != &c->rq)
+			continue;
+		rq = &c->rq;
+		acquire(&rq->lock);
+		if(p->rq == rq){ // not taken off meanwhile
+			rqallow(rq, p->affinity, -1);
+			rqallow(rq, mask, 1);
+			p->affinity = mask;
+			if(!(mask & CPUBIT(c))){
+				rqdel(rq, p);
+				moved = 1;
+			}
+		}
+		release(&rq->lock);
+		break;
+	}
+	p->affinity = mask;
+	if(moved)
+		makerunnable(p);
+	release(&p->lock);
+	return 0;
+}
+
+int
+sys_setaffinity(void)
+{
+	int pid, mask;
+
+	if(argint(0, &pid) < 0 || argint(1, &mask) < 0)
+		return -1;
+	return setaffinity(pid, mask);
+}
+
+// Move pid's process, all its threads, to memory group id;
+// admin only. What it already holds stays charged where it is.
+// Once the first thread has joined, id cannot be deleted, so
+// only that first memcgswitch() can fail.
+int
+memcgmove(int pid, int id)
+{
+	struct proc *p, *t;
+
+	if(!myproc()->mode)
+		return -1;
+	acquire(&ptable.lock);
+	if((p = findproc(pid)) == 0){
+		release(&ptable.lock);
+		return -1;
+	}
+	p = p->leader;
+	for(t = p; t; t = (t == p ? p->threads : t->sibnext)){
+		if(memcgswitch(t->memcg, id) < 0){
+			release(&ptable.lock);
+			return -1;
+		}
+		t->memcg = id;
+	}
+	release(&ptable.lock);
+	return 0;
+}
+
+int
+sys_memcgmove(void)
+{
+	int pid, id;
+
+	if(argint(0, &pid) < 0 || argint(1, &id) < 0)
+		return -1;
+	return memcgmove(pid, id);
+}
+
+// Make the calling process real-time: runtime ticks of cpu
+// in every period ticks, earliest deadline first. runtime
+// 0 makes it ordinary again. Fails if the new total load
+// would pass RTMAXUTIL.
+int
+setrealtime(int runtime, int period)
+{
+	struct proc *p = myproc();
+	int util = 0;
+
+	if(runtime != 0){
+		if(runtime < 0 || period < runtime || period > RTMAXPERIOD)
+			return -1;
+		// Rounded up, so admission never under-counts.
+		util = (runtime * 1000 + period - 1) / period;
+	}
+
+	acquire(&ptable.lock);
+	if(rtload - p->rtutil + util > RTMAXUTIL){
+		release(&ptable.lock);
+		return -1;
+	}
+	rtload += util - p->rtutil;
+	p->rtutil = util;
+	release(&ptable.lock);
+
+	pushcli(); // keep the timer out while the budget changes
+	p->rtruntime = runtime;
+	p->rtperiod = period;
+	p->rtdeadline = ticks + period;
+	p->rtused = 0;
+	p->rtthrottled = 0;
+	popcli();
+	return 0;
+}
+
+int
+sys_setrealtime(void)
+{
+	int runtime, period;
+
+	if(argint(0, &runtime) < 0 || argint(1, &period) < 0)
+		return -1;
+	return setrealtime(runtime, period);
+}
+
+// Copy statistics for up to n live processes out to the
+// pstat array at user address addr. Returns how many.
+int
+getpstat(uint addr, int n)
+{
+	struct proc *p;
+	struct pstat ps;
+	int i = 0;
+
+	for(p = ptable.all; p && i < n; p = p->allnext){
+		acquire(&p->lock);
+		if(p->state == UNUSED){
+			release(&p->lock);
+			continue;
+		}
+		memset(&ps, 0, sizeof(ps));
+		ps.pid = p->pid;
+		ps.state = p->state;
+		safestrcpy(ps.name, p->name, sizeof(ps.name));
+#ifdef MLFQ_SCHED
+		if(p->epoch != boostepoch)
+			ps.level = L0;	// boosted since it last looked
+		else
+			ps.level = p->queue;
+#else
+		ps.level = -1;
+#endif
+		ps.priority = p->priority;
+		ps.cpu = p->last_cpu;
+		ps.cputicks = p->runticks;
+		ps.waitticks = p->waitticks;
+		ps.nvcsw = p->nvcsw;
+		ps.nivcsw = p->nivcsw;
+		release(&p->lock);
+		if(copyout(myproc()->pgdir, addr + i*sizeof(ps), &ps, sizeof(ps)) < 0)
+			return -1;
+		i++;
+	}
+	return i;
+}
+
+int
+sys_getpstat(void)
+{
+	int addr, n;
+	char *buf;
+
+	if(argint(1, &n) < 0 || n < 0 || n > NPROC)
+		return -1;
+	if(argptr(0, &buf, n*sizeof(struct pstat)) < 0)
+		return -1;
+	argint(0, &addr);
+	return getpstat(addr, n);
+}
+
+// On every timer tick, on every cpu: a throttled real-time
+// process queued here whose next period has begun goes back
+// to the heap, rather than waiting behind the policy's queue
+// for its turn as an ordinary process.
+void
+rtreplenish(void)
+{
+	struct runq *rq = &mycpu()->rq;
+	struct proc *p, *next;
+
+	if(rq->throttled == 0) // read without the lock; a miss waits a tick
+		return;
+	acquire(&rq->lock);
+	for(p = rq->throttled; p; p = next){
+		next = p->thnext;
+		if((int)(ticks - p->rtdeadline) < 0)
+			continue;
+		rqdel(rq, p);
+		rqadd(rq, p);  // rtrefresh() starts the new period
+	}
+	release(&rq->lock);
+}
+
+// On a timer tick, should the running process give up the
+// cpu for the real-time class? Yes if it is real-time and
+// has used up this period's budget, which throttles it, or
+// if a real-time process with an earlier deadline than its
+// own is waiting on this cpu.
+int
+rtpreempt(void)
+{
+	struct proc *p = myproc();
+	struct runq *rq = &mycpu()->rq;
+	int preempt;
+
+	rtrefresh(p);
+	if(rtactive(p) && p->rtused >= p->rtruntime){
+		p->rtthrottled = 1;
+		return 1;
+	}
+	acquire(&rq->lock);
+	preempt = rq->rt.n > 0 &&
+		(!rtactive(p) || (int)(rq->rt.p[0]->rtdeadline - p->rtdeadline) < 0);
+	release(&rq->lock);
+	return preempt;
+}
+
 char*
 getshmem(int pid)
 {
@@ -887,11 +2509,22 @@ getshmem(int pid)
 
 	va=0;
 	acquire(&ptable.lock);
-	for(p = ptable.proc; p< &ptable.proc[NPROC]; p++){
-		if(p->pid != 0 && p->pid == pid && p->shared_memory != 0){
-			va = p->shared_memory;
-			break;
+	if((p = findproc(pid)) != 0){
+		p = p->leader;
+		// Allocated on first use rather than in fork(); not once
+		// p has started exiting (cwd is dropped before exit()
+		// frees the page under ptable.lock).
+		if(p->shared_memory == 0 && p->cwd != 0 &&
+		   (p->shared_memory = kalloc()) != 0){
+			memset(p->shared_memory, 0, PGSIZE);
+			// The page is p's, whoever asked first.
+			if(myproc()->memcg != p->memcg &&
+			   kcharge(p->shared_memory, p->memcg) < 0){
+				kfree(p->shared_memory);
+				p->shared_memory = 0;
+			}
 		}
+		va = p->shared_memory;
 	}
 	release(&ptable.lock);
 
@@ -940,6 +2573,16 @@ sys_getshmem(void)
 	return va;
 }
 
+// Print how much of its time each cpu spent halted in idle().
+static void
+idledump(void)
+{
+  struct cpu *c;
+
+  for(c = cpus; c < cpus+ncpu; c++)
+    cprintf("cpu%d: idle %d of %d ticks\n", (int)(c-cpus), c->idleticks, c->nticks);
+}
+
 void
 aligned_print(int num)
 {
@@ -962,16 +2605,11 @@ void
 list_process(void)
 {
 	struct proc *p;
-	int cur_ticks=0;
-
-	acquire(&tickslock);
-	cur_ticks = ticks;
-	release(&tickslock);
 
 	
-	cprintf("NAME          | PID |  TIME  | STACK PAGES | MEMORY (bytes) |  MEMLIM (bytes)\n");
+	cprintf("NAME          | PID |  TIME  | STACK PAGES | MEMORY (bytes) |  MEMLIM (bytes) | CPU | AFFINITY\n");
 	acquire(&ptable.lock);
-	for(p=ptable.proc; p < &ptable.proc[NPROC]; p++){
+	for(p = ptable.all; p; p = p->allnext){
 		if(p->pid != 0 && p->killed != 1){
 			// print name
 			int count = strlen(p->name);
@@ -994,9 +2632,8 @@ list_process(void)
 			cprintf("%d",p->pid);
 			cprintf(" ");
 
-			// print time
-			int time_passed = cur_ticks - p->ticks;
-			aligned_print(time_passed);
+			// print time (CPU ticks used, on any cpu)
+			aligned_print(p->runticks);
 
 			// print stack size
 			cprintf("   ");
@@ -1009,11 +2646,25 @@ list_process(void)
 			// print memory limit
 			cprintf("      ");
 			aligned_print(p->limit);
+
+			// print cpu: the one it runs on, or (the one it last ran on)
+			cprintf("     ");
+			if(p->state == RUNNING)
+				cprintf(" %d ", p->last_cpu);
+			else if(p->last_cpu >= 0)
+				cprintf("(%d)", p->last_cpu);
+			else
+				cprintf(" - ");
+
+			// print affinity mask
+			cprintf("   0x%x", p->affinity & ((1 << ncpu) - 1));
 			cprintf("\n");
 		}
 	}
 	release(&ptable.lock);
 	cprintf("\n");
+	idledump();
+	cprintf("\n");
 }
 
 int
@@ -1031,8 +2682,10 @@ void
 forkret(void)
 {
   static int first = 1;
-  // Still holding ptable.lock from scheduler.
-  release(&ptable.lock);
+  // Still holding p->lock from scheduler, or from the
+  // process that handed over the cpu (with its own).
+  finishswitch();
+  release(&myproc()->lock);
 
   if (first) {
     // Some initialization functions must be run in the context
@@ -1046,12 +2699,29 @@ forkret(void)
   // Return to "caller", actually trapret (see allocproc).
 }
 
-// Atomically release lock and sleep on chan.
-// Reacquires lock when awakened.
-void
-sleep(void *chan, struct spinlock *lk)
+// Caller holds q->lock and p is on q.
+static void
+sleepunlink(struct sleepq *q, struct proc *p)
+{
+  if(p->sprev)
+    p->sprev->snext = p->snext;
+  else
+    q->head = p->snext;
+  if(p->snext)
+    p->snext->sprev = p->sprev;
+  p->snext = p->sprev = 0;
+  p->sq = 0;
+}
+
+// Atomically release lock and sleep on chan; if timed, also
+// wake when ticks reaches deadline.  Reacquires lock when
+// awakened.  Returns 1 if the deadline woke us.
+static int
+sleep1(void *chan, struct spinlock *lk, int timed, uint deadline)
 {
   struct proc *p = myproc();
+  struct sleepq *q;
+  int timedout;
   
   if(p == 0)
     panic("sleep");
@@ -1059,52 +2729,163 @@ sleep(void *chan, struct spinlock *lk)
   if(lk == 0)
     panic("sleep without lk");
 
-  // Must acquire ptable.lock in order to
-  // change p->state and then call sched.
-  // Once we hold ptable.lock, we can be
-  // guaranteed that we won't miss any wakeup
-  // (wakeup runs with ptable.lock locked),
-  // so it's okay to release lk.
-  if(lk != &ptable.lock){  //DOC: sleeplock0
-    acquire(&ptable.lock);  //DOC: sleeplock1
-    release(lk);
+  // Go on chan's bucket, and the timer wheel, before letting
+  // go of lk, so a wakeup() or timertick() after that will
+  // find us.  Must acquire p->lock in order to change
+  // p->state and then call sched.  Once we hold p->lock, we
+  // can be guaranteed that we won't miss any wakeup (wakeup
+  // locks p->lock), so it's okay to release lk.
+  q = sleephash(chan);
+  acquire(&q->lock);
+  p->chan = chan;
+  p->sq = q;
+  p->sprev = 0;
+  p->snext = q->head;
+  if(q->head)
+    q->head->sprev = p;
+  q->head = p;
+  if(timed){
+    acquire(&timers.lock);
+    if((int)(deadline - timers.now) <= 0){
+      // Already due.
+      release(&timers.lock);
+      sleepunlink(q, p);
+      p->chan = 0;
+      release(&q->lock);
+      return 1;
+    }
+    timerlink(p, deadline);
   }
+  acquire(&p->lock);  //DOC: sleeplock1
+  if(timed)
+    release(&timers.lock);
+  release(&q->lock);
+  release(lk);
+
+#ifdef MLFQ_SCHED
+  sleepcredit(p);
+#endif
+
   // Go to sleep.
-  p->chan = chan;
   p->state = SLEEPING;
 
   sched();
 
-  // Tidy up.
+  // Tidy up.  Still on the bucket if something other than
+  // wakeup() (kill, wakeproc, the timer) woke us, and still
+  // on the wheel only if kill did; wakeup() and wakeproc()
+  // take us off it (timercancel()), the timer by firing.
+  release(&p->lock);  //DOC: sleeplock2
+  acquire(&q->lock);
+  if(p->sq)
+    sleepunlink(q, p);
   p->chan = 0;
+  release(&q->lock);
+  timedout = 0;
+  if(timed){
+    acquire(&timers.lock);
+    if(p->ontimer)
+      timerunlink(p);
+    else
+      timedout = 1;
+    release(&timers.lock);
+  }
 
   // Reacquire original lock.
-  if(lk != &ptable.lock){  //DOC: sleeplock2
-    release(&ptable.lock);
-    acquire(lk);
-  }
+  acquire(lk);
+  return timedout;
 }
 
-//PAGEBREAK!
-// Wake up all processes sleeping on chan.
-// The ptable lock must be held.
+void
+sleep(void *chan, struct spinlock *lk)
+{
+  sleep1(chan, lk, 0, 0);
+}
+
+// A timed wait: sleep() on chan, but give up once ticks
+// reaches deadline.  Returns -1 if it did, 0 if woken.
+int
+sleeptimeout(void *chan, struct spinlock *lk, uint deadline)
+{
+  return sleep1(chan, lk, 1, deadline) ? -1 : 0;
+}
+
+// Wake p if it is still asleep on chan.  Caller holds p->lock.
 static void
-wakeup1(void *chan)
+wake1(struct proc *p, void *chan)
 {
-  struct proc *p;
+  struct proc *curproc = myproc();
+
+  if(p->state == SLEEPING && p->chan == chan){
+    wakerunnable(p);
+    if(curproc){ // candidate for a handoff when curproc blocks
+      curproc->woke = p;
+      curproc->wokepid = p->pid;
+    }
+  }
+}
+
+// Called by cpu 0 on every tick: wake the timed sleepers
+// whose deadline is now.  Only the current slot of the wheel
+// is looked at, and in it only entries a whole lap or more
+// away are passed over.
+void
+timertick(uint now)
+{
+  struct proc *p, *next;
 
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+  acquire(&timers.lock);
+  timers.now = now;
+  for(p = timers.slot[now % NTIMERSLOT]; p; p = next){
+    next = p->tnext;
+    if((int)(p->tdeadline - now) > 0)
+      continue;
+    timerunlink(p);
+    acquire(&p->lock);
+    wake1(p, p->chan);
+    release(&p->lock);
+  }
+  release(&timers.lock);
 }
 
+//PAGEBREAK!
 // Wake up all processes sleeping on chan.
+// Must be called without holding any p->lock.
 void
 wakeup(void *chan)
 {
-  acquire(&ptable.lock);
-  wakeup1(chan);
-  release(&ptable.lock);
+  struct proc *p, *next;
+  struct proc *curproc = myproc();
+  struct sleepq *q;
+
+  q = sleephash(chan);
+  acquire(&q->lock);
+  for(p = q->head; p; p = next){
+    next = p->snext;
+    if(p->chan != chan || p == curproc)
+      continue;
+    sleepunlink(q, p);
+    timercancel(p);
+    acquire(&p->lock);
+    wake1(p, chan);
+    release(&p->lock);
+  }
+  release(&q->lock);
+}
+
+// Wake p if it is still asleep on chan; for callers that keep
+// their own list of sleepers.  Must be called without holding
+// p->lock.  The caller's own lock, held across p's sleep1()
+// until p is on the wheel, keeps p asleep on chan meanwhile,
+// so it is p's timer that is cancelled.
+void
+wakeproc(struct proc *p, void *chan)
+{
+  if(p->chan == chan)
+    timercancel(p);
+  acquire(&p->lock);
+  wake1(p, chan);
+  release(&p->lock);
 }
 
 // Kill the process with the given pid.
@@ -1116,18 +2897,14 @@ kill(int pid)
   struct proc *p;
 
   acquire(&ptable.lock);
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-    if(p->pid == pid){
-      p->killed = 1;
-      // Wake process from sleep if necessary.
-      if(p->state == SLEEPING)
-        p->state = RUNNABLE;
-      release(&ptable.lock);
-      return 0;
-    }
+  if((p = findproc(pid)) == 0){
+    release(&ptable.lock);
+    return -1;
   }
+  // Kill every thread of its process.
+  killgroup(p->leader);
   release(&ptable.lock);
-  return -1;
+  return 0;
 }
 
 //PAGEBREAK: 36
@@ -1150,7 +2927,7 @@ procdump(void)
   char *state;
   uint pc[10];
 
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+  for(p = ptable.all; p; p = p->allnext){
     if(p->state == UNUSED)
       continue;
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
@@ -1165,4 +2942,5 @@ procdump(void)
     }
     cprintf("\n");
   }
+  idledump();
 }
@@ -1,3 +1,40 @@
+// List of RUNNABLE processes, linked through proc.qnext/qprev.
+struct procq {
+  struct proc *head;
+  struct proc *tail;
+};
+
+// Binary min-heap of RUNNABLE processes, lowest proc.hkey
+// first.
+struct procheap {
+  struct proc *p[NPROC];
+  int n;
+};
+
+// Per-CPU run queue. A CPU runs what is queued here and
+// steals from the busiest other queue when it runs dry.
+struct runq {
+  struct spinlock lock;
+  int nrun;                    // Number of queued processes
+  int nallow[NCPU];            // ... of which cpus[i] may run
+  struct procheap rt;          // Real-time processes, earliest deadline first
+  struct proc *throttled;      // Throttled real-time processes queued in the policy's lists
+#ifdef MLFQ_SCHED
+  struct procq sys;            // init and login, served first
+  struct procq level[NMLFQ];   // One list per MLFQ level
+  struct procq expired;        // Used up the last level; wait for boost
+  uint epoch;                  // boostepoch the levels were last boosted to
+#elif MULTILEVEL_SCHED
+  struct procq even;           // init, login and even pids, round robin
+  struct procheap odd;         // odd pids, lowest first
+#elif STRIDE_SCHED
+  struct procheap stride;      // lowest pass first
+  uint vpass;                  // pass of the process picked last
+#else
+  struct procq q;
+#endif
+};
+
 // Per-CPU state
 struct cpu {
   uchar apicid;                // Local APIC ID
@@ -8,6 +45,14 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  struct runq rq;              // Processes waiting to run on this cpu
+  volatile uint halted;        // In hlt, waiting for work?
+  volatile uint tlbflush;      // Asked by tlbshootdown() to flush its TLB
+  int intr;                    // In trap() for anything but a system call
+  uint nticks;                 // Timer interrupts taken
+  uint idleticks;              // ... of which arrived while halted
+  uint tscstamp;               // rdtsc() when proc was last charged
+  struct proc *prev;           // Handed this cpu over; its lock is still held
 };
 
 extern struct cpu cpus[NCPU];
@@ -33,17 +78,37 @@ struct context {
 };
 
 enum queueLevel { L0, L1, L2, L3, L4 };
+
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 
 // Per-process state
 struct proc {
+  struct spinlock lock;        // Guards state, chan, killed and swtch
   uint sz;                     // Size of process memory (bytes)
   pde_t* pgdir;                // Page table
   char *kstack;                // Bottom of kernel stack for this process
   enum procstate state;        // Process state
   int pid;                     // Process ID
   struct proc *parent;         // Parent process
+  struct proc *children;       // Children still running
+  struct proc *zombies;        // Children exited but not yet waited for
+  struct proc *sibnext;        // Next on parent's children or zombies
+  struct proc *sibprev;        // Previous on parent's children or zombies
+                               // (for a thread: on leader's threads)
+  struct proc *leader;         // Main thread; owns ofile, cwd, children, limit
+  struct proc *threads;        // Leader only: its other threads
+  void *retval;                // Thread: value passed to thread_exit()
+  pde_t *futexspace;           // futex_wait() key: pgdir, or 0 for a getshmem() page
+  uint futexkey;               // ... and virtual or physical address; both 0 if not waiting
+  struct proc *fnext;          // Next in the futex wait queue
+  struct sleepq *sq;           // Bucket of sleep channels p is on, or 0
+  struct proc *snext;          // Next on sq
+  struct proc *sprev;          // Previous on sq
+  int ontimer;                 // On the timer wheel, in sleeptimeout()
+  uint tdeadline;              // ... until ticks reaches this
+  struct proc *tnext;          // Next in its timer wheel slot
+  struct proc *tprev;          // Previous in its timer wheel slot
   struct trapframe *tf;        // Trap frame for current syscall
   struct context *context;     // swtch() here to run process
   void *chan;                  // If non-zero, sleeping on chan
@@ -53,15 +118,56 @@ struct proc {
   char name[16];               // Process name (debugging)
 
   int priority;
-  uint ticks;
+  uint ticks;                  // CPU ticks used at the current MLFQ level
+  uint runticks;               // CPU ticks used in all
+  uint runcycles;              // Used cycles short of a whole tick
+  uint waitticks;              // Ticks spent RUNNABLE, waiting to run
+  uint waitcycles;             // Waited cycles short of a whole tick
+  uint readytsc;               // rdtsc() when it last became RUNNABLE
+  uint readyticks;             // ticks when it last became RUNNABLE
+  uint nvcsw;                  // Switches out to wait (sleep, exit)
+  uint nivcsw;                 // Switches out while still RUNNABLE
   enum queueLevel queue;
   int lastqueue;
+  uint epoch;                  // boostepoch queue/ticks/lastqueue are current for
+  int earlysleeps;             // Slept before the quantum ran out, times in a row
   int ppid;
   int mode;					   // user mode or administrator mode
   int limit;				   // memory limit
+  int memcg;                   // Memory group its pages are charged to
   char *shared_memory;		   // shared memory address
-  int stack_count;			   // count of pages
+  int stack_count;			   // count of stack pages in use
+  uint stackbase;              // lowest address the stack may grow to
+  uint stacktop;               // top of the stack, just below the heap
+  struct {
+    uint base, top;            // guard page and stack, [base, top)
+  } freestack[NFREESTACK];     // Leader: reaped thread stacks for clone()
+  int nfreestack;              // Entries in use in freestack
   char *username;			   // store username for fs.c
+  struct proc *qnext;          // next in run queue
+  struct proc *qprev;          // previous in run queue
+  struct runq *rq;             // run queue p is on, or 0
+  struct procq *pq;            // list within rq, or 0
+  struct procheap *ph;         // heap within rq, or 0
+  int hidx;                    // index in ph
+  uint hkey;                   // ph's order: pid, deadline or pass
+  uint pass;                   // Stride: virtual time used, in strides
+  uint stride;                 // Stride: added to pass per tick of cpu
+  int rtruntime;               // Real-time budget, ticks per period; 0 if not real-time
+  int rtperiod;                // Real-time period in ticks
+  uint rtdeadline;             // ticks at which the current period ends
+  int rtused;                  // Ticks used so far this period
+  int rtthrottled;             // Used up rtruntime; ordinary class until the period ends
+  int rtutil;                  // rtruntime/rtperiod, per mille, counted in rtutil
+  int onthrottled;             // On its run queue's throttled list
+  struct proc *thnext;         // Next on the throttled list
+  struct proc *thprev;         // Previous on the throttled list
+  int last_cpu;                // Index of the cpu it last ran on, or -1
+  uint affinity;               // Bit i set: may run on cpus[i]
+  struct proc *allnext;        // Next in ptable.all
+  struct proc *hnext;          // Next in ptable's pid hash chain or free list
+  struct proc *woke;           // Last process this one woke up
+  int wokepid;                 // ... and its pid then
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -0,0 +1,14 @@
+// Per-process scheduling statistics, as returned by
+// getpstat().  state is an enum procstate value.
+struct pstat {
+  int pid;
+  int state;
+  char name[16];
+  int level;               // MLFQ level, -1 under other policies
+  int priority;
+  int cpu;                 // cpu it runs or last ran on, -1 if none
+  uint cputicks;           // Ticks of cpu used
+  uint waitticks;          // Ticks spent RUNNABLE, waiting for a cpu
+  uint nvcsw;              // Gave up the cpu to wait (sleep, exit)
+  uint nivcsw;             // Was made to give it up while runnable
+};
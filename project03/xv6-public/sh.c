@@ -50,8 +50,11 @@ struct backcmd {
 };
 
 int fork1(void);  // Fork but panics on failure.
+int spawnline(char*);
 void panic(char*);
 struct cmd *parsecmd(char*);
+extern char whitespace[];
+extern char symbols[];
 
 // Execute cmd.  Never returns.
 void
@@ -157,6 +160,7 @@ main(void)
   }
 
   // Read and run input commands.
+  int pid;
   while(getcmd(buf, sizeof(buf)) >= 0){
     if(buf[0] == 'c' && buf[1] == 'd' && buf[2] == ' '){
       // Chdir must be called by the parent, not the child.
@@ -170,7 +174,9 @@ main(void)
 		exit();
 	}
 
-    if(fork1() == 0)
+    if((pid = spawnline(buf)) == 0)
+      continue;
+    if(pid < 0 && fork1() == 0)
       runcmd(parsecmd(buf));
     wait();
   }
@@ -195,6 +201,46 @@ fork1(void)
   return pid;
 }
 
+// Run a plain "prog arg ..." line with spawn(), which skips
+// copying the shell.  Return the child's pid, 0 if there was
+// nothing to wait for, or -1 if the line needs the parser
+// (redirection, pipes, lists, too many args) and a fork.
+int
+spawnline(char *buf)
+{
+  static char line[100];
+  char *argv[MAXARGS], *s;
+  int argc, pid;
+
+  for(s = buf; *s; s++)
+    if(strchr(symbols, *s))
+      return -1;
+  strcpy(line, buf);
+
+  argc = 0;
+  s = line;
+  for(;;){
+    while(*s && strchr(whitespace, *s))
+      *s++ = 0;
+    if(*s == 0)
+      break;
+    if(argc >= MAXARGS-1)
+      return -1;
+    argv[argc++] = s;
+    while(*s && !strchr(whitespace, *s))
+      s++;
+  }
+  argv[argc] = 0;
+  if(argc == 0)
+    return 0;
+
+  if((pid = spawn(argv[0], argv, 0, 0)) < 0){
+    printf(2, "exec %s failed\n", argv[0]);
+    return 0;
+  }
+  return pid;
+}
+
 //PAGEBREAK!
 // Constructors
 
@@ -0,0 +1,12 @@
+// File actions for spawn(), applied in order to the child's
+// copy of the parent's open files.  The list ends with SPAWN_END.
+#define SPAWN_END     0
+#define SPAWN_DUP2    1   // child's newfd = child's fd
+#define SPAWN_CLOSE   2   // close child's fd
+#define SPAWN_DETACH  3   // give the child to init; the caller won't wait()
+
+struct spawnfd {
+  int op;
+  int fd;
+  int newfd;
+};
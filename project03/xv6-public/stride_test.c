@@ -0,0 +1,93 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+// Build with SCHED_POLICY=STRIDE_SCHED. Children with
+// priorities 0..NUM_THREAD-1 (1..NUM_THREAD tickets) spin
+// for the same stretch of time; each one's share of the
+// total work should match its share of the tickets.
+// The split is per cpu, so the test pins itself, and with
+// it every child, to cpu 0; that needs admin mode, with
+// the password from argv[1] if given.
+
+#define NUM_THREAD 4
+#define SPIN_TICKS 300
+#define TOLERANCE 30   // per mille
+
+char *password = "2015005141";
+
+int
+main(int argc, char *argv[])
+{
+  int i, pid, start, fds[2];
+  int pids[NUM_THREAD];
+  uint count, counts[NUM_THREAD], total;
+  int tickets, sum, want, got, diff, fail;
+
+  if(pipe(fds) < 0){
+    printf(1, "pipe failed\n");
+    exit();
+  }
+  if(argc > 1)
+    password = argv[1];
+  if(getadmin(password) < 0 || setaffinity(getpid(), 1) < 0){
+    printf(1, "cannot pin to cpu 0; stride test failed\n");
+    exit();
+  }
+
+  printf(1, "stride test start\n");
+  start = uptime() + 20;
+  for(i = 0; i < NUM_THREAD; i++){
+    if((pid = fork()) == 0){
+      close(fds[0]);
+      while(uptime() < start)
+        sleep(1);
+      count = 0;
+      while(uptime() < start + SPIN_TICKS)
+        count++;
+      write(fds[1], &i, sizeof(i));
+      write(fds[1], &count, sizeof(count));
+      exit();
+    }
+    if(pid < 0){
+      printf(1, "fork failed\n");
+      exit();
+    }
+    pids[i] = pid;
+    if(setpriority(pid, i) < 0){
+      printf(1, "setpriority failed\n");
+      exit();
+    }
+  }
+  close(fds[1]);
+
+  total = 0;
+  for(i = 0; i < NUM_THREAD; i++){
+    int who;
+    if(read(fds[0], &who, sizeof(who)) != sizeof(who) ||
+       read(fds[0], &count, sizeof(count)) != sizeof(count) ||
+       who < 0 || who >= NUM_THREAD){
+      printf(1, "short read from children\n");
+      exit();
+    }
+    counts[who] = count;
+    total += count;
+  }
+  for(i = 0; i < NUM_THREAD; i++)
+    wait();
+
+  sum = NUM_THREAD * (NUM_THREAD + 1) / 2;
+  fail = 0;
+  for(i = 0; i < NUM_THREAD; i++){
+    tickets = i + 1;
+    want = tickets * 1000 / sum;
+    got = total ? counts[i] / (total / 1000 + 1) : 0;
+    diff = got > want ? got - want : want - got;
+    printf(1, "pid %d: %d tickets, want %d, got %d per mille\n",
+        pids[i], tickets, want, got);
+    if(diff > TOLERANCE)
+      fail = 1;
+  }
+  printf(1, fail ? "stride test failed\n" : "stride test passed\n");
+  exit();
+}
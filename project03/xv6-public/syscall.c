@@ -3,6 +3,7 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "x86.h"
 #include "syscall.h"
@@ -21,6 +22,8 @@ fetchint(uint addr, int *ip)
 
   if(addr >= curproc->sz || addr+4 > curproc->sz)
     return -1;
+  if(uvmprepare(curproc->pgdir, addr, 4, curproc->sz, 0) < 0)
+    return -1;
   *ip = *(int*)(addr);
   return 0;
 }
@@ -39,6 +42,9 @@ fetchstr(uint addr, char **pp)
   *pp = (char*)addr;
   ep = (char*)curproc->sz;
   for(s = *pp; s < ep; s++){
+    if((s == *pp || ((uint)s % PGSIZE) == 0) &&
+       uvmprepare(curproc->pgdir, (uint)s, 1, curproc->sz, 0) < 0)
+      return -1;
     if(*s == 0)
       return s - *pp;
   }
@@ -65,6 +71,10 @@ argptr(int n, char **pp, int size)
     return -1;
   if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz)
     return -1;
+  // The kernel may write the block (read(), pipe()), so make
+  // it writable now rather than fault on it later.
+  if(uvmprepare(curproc->pgdir, i, size, curproc->sz, 1) < 0)
+    return -1;
   *pp = (char*)i;
   return 0;
 }
@@ -120,6 +130,21 @@ extern int sys_openfile(void);
 extern int sys_useradd(void);
 extern int sys_userdel(void);
 extern int sys_retusername(void);
+extern int sys_mlfqctl(void);
+extern int sys_setaffinity(void);
+extern int sys_setrealtime(void);
+extern int sys_getpstat(void);
+extern int sys_spawn(void);
+extern int sys_clone(void);
+extern int sys_thread_exit(void);
+extern int sys_thread_join(void);
+extern int sys_futex_wait(void);
+extern int sys_futex_wake(void);
+extern int sys_memcgcreate(void);
+extern int sys_memcgdelete(void);
+extern int sys_memcglimit(void);
+extern int sys_memcgmove(void);
+extern int sys_memcgstat(void);
 
 
 static int (*syscalls[])(void) = {
@@ -158,6 +183,21 @@ static int (*syscalls[])(void) = {
 [SYS_useradd]  sys_useradd,
 [SYS_userdel]  sys_userdel,
 [SYS_retusername]	sys_retusername,
+[SYS_mlfqctl]  sys_mlfqctl,
+[SYS_setaffinity]  sys_setaffinity,
+[SYS_setrealtime]  sys_setrealtime,
+[SYS_getpstat]  sys_getpstat,
+[SYS_spawn]    sys_spawn,
+[SYS_clone]    sys_clone,
+[SYS_thread_exit] sys_thread_exit,
+[SYS_thread_join] sys_thread_join,
+[SYS_futex_wait] sys_futex_wait,
+[SYS_futex_wake] sys_futex_wake,
+[SYS_memcgcreate] sys_memcgcreate,
+[SYS_memcgdelete] sys_memcgdelete,
+[SYS_memcglimit] sys_memcglimit,
+[SYS_memcgmove] sys_memcgmove,
+[SYS_memcgstat] sys_memcgstat,
 };
 
 void
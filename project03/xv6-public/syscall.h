@@ -34,4 +34,19 @@
 #define SYS_useradd 33
 #define SYS_userdel 34
 #define SYS_retusername 35
+#define SYS_mlfqctl 36
+#define SYS_setaffinity 37
+#define SYS_setrealtime 38
+#define SYS_getpstat 39
+#define SYS_spawn 40
+#define SYS_clone 41
+#define SYS_thread_exit 42
+#define SYS_thread_join 43
+#define SYS_futex_wait 44
+#define SYS_futex_wake 45
+#define SYS_memcgcreate 46
+#define SYS_memcgdelete 47
+#define SYS_memcglimit 48
+#define SYS_memcgmove 49
+#define SYS_memcgstat 50
 
@@ -5,6 +5,7 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 
 int
@@ -26,6 +27,39 @@ sys_wait(void)
   return wait();
 }
 
+int
+sys_clone(void)
+{
+  int start, fn, arg, stackpages;
+
+  if(argint(0, &start) < 0 || argint(1, &fn) < 0 ||
+     argint(2, &arg) < 0 || argint(3, &stackpages) < 0)
+    return -1;
+  return clone(start, fn, arg, stackpages);
+}
+
+int
+sys_thread_exit(void)
+{
+  int retval;
+
+  if(argint(0, &retval) < 0)
+    return -1;
+  thread_exit((void*)retval);
+  return 0;  // not reached
+}
+
+int
+sys_thread_join(void)
+{
+  int tid;
+  char *retval;
+
+  if(argint(0, &tid) < 0 || argptr(1, &retval, sizeof(void*)) < 0)
+    return -1;
+  return thread_join(tid, (void**)retval);
+}
+
 int
 sys_kill(void)
 {
@@ -71,7 +105,8 @@ sys_sleep(void)
       release(&tickslock);
       return -1;
     }
-    sleep(&ticks, &tickslock);
+    // Only the timer wheel wakes us, once the time is up.
+    sleeptimeout(&ticks, &tickslock, ticks0 + n);
   }
   release(&tickslock);
   return 0;
@@ -3,22 +3,20 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
+#include "mlfq.h"
 #include "proc.h"
 #include "x86.h"
 #include "traps.h"
-#include "spinlock.h"
 
 // Interrupt descriptor table (shared by all CPUs).
 struct gatedesc idt[256];
 extern uint vectors[];  // in vectors.S: array of 256 entry pointers
 struct spinlock tickslock;
 uint ticks;
+uint tsc_per_tick;  // rdtsc() cycles per timer tick, as measured on cpu 0
+static uint lasttsc;
 
-#ifdef MLFQ_SCHED
-	const int time_limit = 100;
-	enum queueLevel queue_L;
-	int quantum[5]={ 4, 6, 8, 10, 12};
-#endif
 
 void
 tvinit(void)
@@ -42,6 +40,8 @@ idtinit(void)
 void
 trap(struct trapframe *tf)
 {
+  int mapped;
+
   if(tf->trapno == T_SYSCALL){
     if(myproc()->killed)
       exit();
@@ -52,16 +52,39 @@ trap(struct trapframe *tf)
     return;
   }
 
+  // Wakeups from here are not by the running process
+  // (wakerunnable()).
+  mycpu()->intr = 1;
   switch(tf->trapno){
   case T_IRQ0 + IRQ_TIMER:
+    // Sample whether this cpu sat halted in idle().
+    mycpu()->nticks++;
+    if(mycpu()->halted)
+      mycpu()->idleticks++;
     if(cpuid() == 0){
+      uint now = rdtsc();
+      if(lasttsc)
+        tsc_per_tick = tsc_per_tick ? (3*tsc_per_tick + (now - lasttsc))/4 : now - lasttsc;
+      lasttsc = now;
       acquire(&tickslock);
       ticks++;
-	  if(myproc())
-	  	myproc()->ticks++;
-      wakeup(&ticks);
       release(&tickslock);
+      // sys_sleep() and other timed waits are on the timer
+      // wheel; only those due now are woken.
+      timertick(ticks);
     }
+    // Every cpu charges its own process, so quanta run
+    // out wherever the process happens to be running.
+    chargetime();
+    rtreplenish();
+    lapiceoi();
+    break;
+  case T_IRQ0 + IRQ_WAKEUP:
+    // Nothing to do; waking up from idle() was the point.
+    lapiceoi();
+    break;
+  case T_IRQ0 + IRQ_TLB:
+    tlbcheck();
     lapiceoi();
     break;
   case T_IRQ0 + IRQ_IDE:
@@ -86,8 +109,38 @@ trap(struct trapframe *tf)
     lapiceoi();
     break;
 
+  case T_PGFLT:
+    // First touch of heap that sbrk() only reserved, or of
+    // stack that exec reserved?  Count a stack page only if
+    // this fault mapped it, not another thread's.
+    if(myproc() && !(tf->err & FEC_PR) &&
+       (mapped = lazyfault(myproc()->pgdir, rcr2(), myproc()->sz, tf->err & FEC_WR)) >= 0){
+      if(mapped == 1 && rcr2() >= myproc()->stackbase && rcr2() < myproc()->stacktop)
+        myproc()->stack_count++;
+      break;
+    }
+    // A write to a copy-on-write page, by user code or by
+    // the kernel on its behalf (CR0_WP is set)?
+    if(myproc() && (tf->err & FEC_WR) && cowfault(myproc()->pgdir, rcr2()) == 0)
+      break;
+    // fall through
+
   //PAGEBREAK: 13
   default:
+    if(myproc() && (tf->cs&3) == 0 && tf->trapno == T_PGFLT &&
+       rcr2() < KERNBASE && mycpu()->ncli == 0){
+      // The kernel touched user memory for the process and the
+      // fault could not be resolved (memory ran out, or another
+      // thread shrank the heap after the syscall checked its
+      // arguments).  The process pays for it, not the kernel;
+      // it holds no spinlocks, so it can exit from here.
+      cprintf("pid %d %s: kernel fault on user addr 0x%x "
+              "eip 0x%x--kill proc\n",
+              myproc()->pid, myproc()->name, rcr2(), tf->eip);
+      myproc()->killed = 1;
+      mycpu()->intr = 0;
+      exit();
+    }
     if(myproc() == 0 || (tf->cs&3) == 0){
       // In kernel, it must be our mistake.
       cprintf("unexpected trap %d from cpu %d eip %x (cr2=0x%x)\n",
@@ -101,6 +154,7 @@ trap(struct trapframe *tf)
             tf->err, cpuid(), tf->eip, rcr2());
     myproc()->killed = 1;
   }
+  mycpu()->intr = 0;
 
   // Force process exit if it has been killed and is in user space.
   // (If it is still executing in the kernel, let it keep running
@@ -108,35 +162,31 @@ trap(struct trapframe *tf)
   if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
  	exit();
 
+  // Real-time budget and preemption, under every policy.
+  int rtyield = myproc() && myproc()->state == RUNNING &&
+    tf->trapno == T_IRQ0 + IRQ_TIMER && rtpreempt();
 
 #ifdef MLFQ_SCHED
 	  
-	if(tf->trapno == T_IRQ0 + IRQ_TIMER &&( (ticks%time_limit) == 0)){
+	// Only cpu 0 advances ticks, so only it starts boosts.
+	if(tf->trapno == T_IRQ0 + IRQ_TIMER && cpuid() == 0 && (ticks%mlfq.boost) == 0){
 		priority_boosting();
 	}
 
-	else{
-  		for(int i = 0 ; i< MLFQ_K ; i++){
-	  
-	  		if( i == MLFQ_K - 1){	  
-	  			if(myproc() && myproc() -> state == RUNNING && tf->trapno == T_IRQ0 + IRQ_TIMER
-			  	&& myproc()->queue == i && myproc()->ticks > quantum[i]){
-					myproc()->ticks = 0;
-				//	myproc()->queue = L0;
-		  			yield_MLFQ_last_Level(i);
-				//	yield();
-  	  			}	   
-	  		}	
-
-
-	  		else if(myproc() && myproc() -> state == RUNNING && tf->trapno == T_IRQ0 + IRQ_TIMER
-		  			&& myproc()->queue == i && myproc()->ticks > quantum[i]){
-				myproc()->ticks = 0;
-			//	myproc()->queue = L0;
-		  		yield_MLFQ(i);
-			//	yield();
-  	  		}
-  		}
+	if(rtyield)
+		yield();
+
+	// Quanta and the level count are the live values from mlfqctl().
+	else if(myproc() && myproc() -> state == RUNNING && tf->trapno == T_IRQ0 + IRQ_TIMER){
+		renormalize(myproc());
+		int i = myproc()->queue;
+		if(myproc()->ticks > mlfq.quantum[i]){
+			myproc()->ticks = 0;
+			if(i >= mlfq.nlevel - 1)
+				yield_MLFQ_last_Level(i);
+			else
+				yield_MLFQ(i);
+		}
 	}
  
 #endif
@@ -144,8 +194,8 @@ trap(struct trapframe *tf)
   // Force process to give up CPU on clock tick.
   // If interrupts were on while locks held, would need to check nlock.
 #ifdef MULTILEVEL_SCHED
-	if(myproc() && myproc()->state == RUNNING &&
-     	tf->trapno == T_IRQ0+IRQ_TIMER)
+	if(rtyield || (myproc() && myproc()->state == RUNNING &&
+     	tf->trapno == T_IRQ0+IRQ_TIMER))
     		yield();
 	if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
     	exit();
@@ -155,8 +205,8 @@ trap(struct trapframe *tf)
     	exit();
 
 #else
-	if(myproc() && myproc()->state == RUNNING &&
-     	tf->trapno == T_IRQ0+IRQ_TIMER)
+	if(rtyield || (myproc() && myproc()->state == RUNNING &&
+     	tf->trapno == T_IRQ0+IRQ_TIMER))
     		yield();
   	// Check if the process has been killed since we yielded
   	if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
@@ -34,5 +34,7 @@
 #define IRQ_COM1         4
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_WAKEUP      20      // IPI to a halted cpu
+#define IRQ_TLB         21      // IPI: flush this cpu's TLB
 #define IRQ_SPURIOUS    31
 
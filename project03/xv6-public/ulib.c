@@ -104,3 +104,71 @@ memmove(void *vdst, const void *vsrc, int n)
     *dst++ = *src++;
   return vdst;
 }
+
+// First code a new thread runs; clone() left fn and arg
+// on its stack as our arguments.
+static void
+threadstart(void *(*fn)(void*), void *arg)
+{
+  thread_exit(fn(arg));
+}
+
+// Run fn(arg) in a new thread of this process with a stack of
+// stackpages pages.  Returns its thread id for thread_join().
+int
+thread_create(void *(*fn)(void*), void *arg, int stackpages)
+{
+  return clone(threadstart, fn, arg, stackpages);
+}
+
+// Mutexes and condition variables that sleep in the kernel
+// (futex_wait) rather than spin.  The mutex only enters the
+// kernel when it is contended (state 2).
+void
+mutex_lock(struct mutex *m)
+{
+  int c;
+
+  if((c = __sync_val_compare_and_swap(&m->state, 0, 1)) == 0)
+    return;
+  if(c != 2)
+    c = __sync_lock_test_and_set(&m->state, 2);
+  while(c != 0){
+    futex_wait(&m->state, 2);
+    c = __sync_lock_test_and_set(&m->state, 2);
+  }
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+  if(__sync_fetch_and_sub(&m->state, 1) != 1){
+    m->state = 0;
+    futex_wake(&m->state, 1);
+  }
+}
+
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+  int seq;
+
+  seq = c->seq;
+  mutex_unlock(m);
+  futex_wait(&c->seq, seq);
+  mutex_lock(m);
+}
+
+void
+cond_signal(struct cond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futex_wake(&c->seq, 1);
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futex_wake(&c->seq, 0x7fffffff);  // all of them
+}
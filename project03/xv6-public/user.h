@@ -1,5 +1,14 @@
 struct stat;
 struct rtcdate;
+struct mlfqinfo;
+struct pstat;
+struct spawnfd;
+struct memcginfo;
+
+// Zero-initialized; may live in a getshmem() page to be
+// shared between processes.
+struct mutex { volatile int state; };  // 0 free, 1 locked, 2 contended
+struct cond { volatile int seq; };
 
 // system calls
 int fork(void);
@@ -37,6 +46,21 @@ int openfile(char*);
 int useradd(char*, char*);
 int userdel(char*);
 void retusername(char*);
+int mlfqctl(struct mlfqinfo*, struct mlfqinfo*);
+int setaffinity(int, int);
+int setrealtime(int, int);
+int getpstat(struct pstat*, int);
+int spawn(char*, char**, int, struct spawnfd*);
+int clone(void*, void*, void*, int);
+void thread_exit(void*) __attribute__((noreturn));
+int thread_join(int, void**);
+int futex_wait(volatile void*, int);
+int futex_wake(volatile void*, int);
+int memcgcreate(char*, int);
+int memcgdelete(int);
+int memcglimit(int, int, int);
+int memcgmove(int, int);
+int memcgstat(int, struct memcginfo*);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -51,3 +75,9 @@ void* memset(void*, int, uint);
 void* malloc(uint);
 void free(void*);
 int atoi(const char*);
+int thread_create(void*(*)(void*), void*, int);
+void mutex_lock(struct mutex*);
+void mutex_unlock(struct mutex*);
+void cond_wait(struct cond*, struct mutex*);
+void cond_signal(struct cond*);
+void cond_broadcast(struct cond*);
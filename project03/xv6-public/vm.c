@@ -4,12 +4,19 @@
 #include "x86.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
 #include "proc.h"
 #include "elf.h"
+#include "traps.h"
 
 
 extern char data[];  // defined by kernel.ld
 pde_t *kpgdir;  // for use in scheduler()
+static char *zeropage;  // mapped read-only for untouched heap pages;
+                        // never reference counted or freed
+// Threads share a pgdir and may fault on the same page at
+// once; lazyfault() and cowfault() update it under this lock.
+static struct spinlock faultlock;
 
 // Set up CPU's kernel segment descriptors.
 // Run once on entry on each CPU.
@@ -178,6 +185,52 @@ switchuvm(struct proc *p)
   popcli();
 }
 
+// Flush this cpu's TLB if tlbshootdown() asked for it.
+// Interrupts must be off.
+void
+tlbcheck(void)
+{
+  struct cpu *c;
+
+  c = mycpu();
+  if(c->tlbflush){
+    lcr3(rcr3());
+    c->tlbflush = 0;
+  }
+}
+
+// An entry in pgdir lost PTE_W or was unmapped, and threads
+// sharing pgdir may be running on other cpus with the old
+// entry in their TLBs. Flush this cpu's TLB and every cpu
+// running on pgdir, and return once all of them have. A
+// cpu that came to pgdir after the entry changed loaded
+// cr3 since, so it has nothing stale. While waiting, this
+// cpu answers other shootdowns itself, and a cpu spinning
+// in acquire() answers from there, so a lock held across
+// the call cannot deadlock.
+void
+tlbshootdown(pde_t *pgdir)
+{
+  struct cpu *c, *me;
+  struct proc *p;
+
+  pushcli();
+  me = mycpu();
+  if(rcr3() == V2P(pgdir))
+    lcr3(V2P(pgdir));
+  __sync_synchronize();  // the entry is changed before c->proc is read
+  for(c = cpus; c < cpus+ncpu; c++){
+    if(c == me || (p = c->proc) == 0 || p->pgdir != pgdir)
+      continue;
+    c->tlbflush = 1;
+    lapicipi(c->apicid, T_IRQ0 + IRQ_TLB);
+  }
+  for(c = cpus; c < cpus+ncpu; c++)
+    while(c->tlbflush)
+      tlbcheck();
+  popcli();
+}
+
 // Load the initcode into address 0 of pgdir.
 // sz must be less than a page.
 void
@@ -275,13 +328,55 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
       if(pa == 0)
         panic("kfree");
       char *v = P2V(pa);
-      kfree(v);
+      if(pa != V2P(zeropage))
+        kfree(v);
       *pte = 0;
     }
   }
   return newsz;
 }
 
+// deallocuvm() for a pgdir that other threads may be
+// running on: pages are unmapped, then every TLB that may
+// still hold them is flushed, and only then are they freed,
+// a batch at a time.
+int
+shrinkuvm(pde_t *pgdir, uint oldsz, uint newsz)
+{
+  pte_t *pte;
+  uint a, pa[32];
+  int i, n, unmapped;
+
+  if(newsz >= oldsz)
+    return oldsz;
+
+  a = PGROUNDUP(newsz);
+  while(a < oldsz){
+    n = unmapped = 0;
+    acquire(&faultlock);
+    for(; a < oldsz && n < NELEM(pa); a += PGSIZE){
+      pte = walkpgdir(pgdir, (char*)a, 0);
+      if(!pte)
+        a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
+      else if((*pte & PTE_P) != 0){
+        if((pa[n] = PTE_ADDR(*pte)) == 0)
+          panic("kfree");
+        if(pa[n] != V2P(zeropage))
+          n++;
+        *pte = 0;
+        unmapped = 1;
+      }
+    }
+    release(&faultlock);
+    if(!unmapped)
+      continue;
+    tlbshootdown(pgdir);
+    for(i = 0; i < n; i++)
+      kfree(P2V(pa[i]));
+  }
+  return newsz;
+}
+
 // Free a page table and all the physical memory pages
 // in the user part.
 void
@@ -315,7 +410,9 @@ clearpteu(pde_t *pgdir, char *uva)
 }
 
 // Given a parent process's page table, create a copy
-// of it for a child.
+// of it for a child. The parent's writable pages become
+// copy-on-write, so its threads' TLBs are shot down before
+// the child can run.
 pde_t*
 copyuvm(pde_t *pgdir, uint sz)
 {
@@ -326,28 +423,193 @@ copyuvm(pde_t *pgdir, uint sz)
 
   if((d = setupkvm()) == 0)
     return 0;
+  acquire(&faultlock);
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
-    if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
+    // Heap pages never touched (lazyfault()) stay unmapped.
+    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0 || !(*pte & PTE_P))
+      continue;
     pa = PTE_ADDR(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto bad;
-    memmove(mem, (char*)P2V(pa), PGSIZE);
-    if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0) {
-      kfree(mem);
-      goto bad;
+    if(!(*pte & PTE_U)){
+      // The stack guard page: cowfault() only handles user
+      // pages, and the kernel may still write it, so copy it now.
+      if((mem = kalloc()) == 0)
+        goto bad;
+      memmove(mem, (char*)P2V(pa), PGSIZE);
+      if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0){
+        kfree(mem);
+        goto bad;
+      }
+      continue;
+    }
+    // Share the page; whichever side writes it first
+    // gets its own copy (cowfault()).
+    if(*pte & PTE_W){
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+      flags = PTE_FLAGS(*pte);
     }
+    if(mappages(d, (void*)i, PGSIZE, pa, flags) < 0)
+      goto bad;
+    if(pa != V2P(zeropage))
+      kref(P2V(pa));
   }
+  release(&faultlock);
+  tlbshootdown(pgdir);
   return d;
 
 bad:
+  release(&faultlock);
+  tlbshootdown(pgdir);
   freevm(d);
   return 0;
 }
 
+// A write hit the copy-on-write page at va in pgdir. Give
+// pgdir its own copy of the page, or, if nothing else maps
+// it any more, just make it writable again. Returns -1 if
+// va is not a copy-on-write user page or memory ran out.
+int
+cowfault(pde_t *pgdir, uint va)
+{
+  pte_t *pte;
+  uint pa, flags;
+  char *mem;
+
+  if(va >= KERNBASE || (pte = walkpgdir(pgdir, (char*)va, 0)) == 0)
+    return -1;
+  acquire(&faultlock);
+  if((*pte & (PTE_P|PTE_U|PTE_W)) == (PTE_P|PTE_U|PTE_W)){
+    // Another thread got here first.
+    release(&faultlock);
+    lcr3(V2P(pgdir));
+    return 0;
+  }
+  if((*pte & (PTE_P|PTE_U|PTE_COW)) != (PTE_P|PTE_U|PTE_COW)){
+    release(&faultlock);
+    return -1;
+  }
+  pa = PTE_ADDR(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+  if(pa != V2P(zeropage) && krefcount(P2V(pa)) == 1){
+    *pte = pa | flags;
+    release(&faultlock);
+    lcr3(V2P(pgdir));  // flush the stale read-only entry
+    return 0;
+  }
+  if((mem = kalloc()) == 0){
+    release(&faultlock);
+    return -1;
+  }
+  memmove(mem, P2V(pa), PGSIZE);
+  *pte = V2P(mem) | flags;
+  release(&faultlock);
+  // Other threads may still reach the old page through
+  // their TLBs; let go of it only once they can't.
+  tlbshootdown(pgdir);
+  if(pa != V2P(zeropage))
+    kfree(P2V(pa));
+  return 0;
+}
+
+// Allocate the shared zero page.  Called once, after kinit2().
+void
+zeroinit(void)
+{
+  initlock(&faultlock, "fault");
+  if((zeropage = kalloc()) == 0)
+    panic("zeroinit");
+  memset(zeropage, 0, PGSIZE);
+}
+
+// va lies below sz but was never mapped: growproc() only
+// reserves address space.  A read maps the shared zero page
+// copy-on-write; a write gets a fresh zeroed page.  Returns 1
+// if it mapped the page, 0 if another thread already had, and
+// -1 if va is not such a page or memory ran out.
+int
+lazyfault(pde_t *pgdir, uint va, uint sz, int write)
+{
+  pte_t *pte;
+  char *mem;
+
+  if(va >= sz || va >= KERNBASE)
+    return -1;
+  va = PGROUNDDOWN(va);
+  acquire(&faultlock);
+  if((pte = walkpgdir(pgdir, (char*)va, 0)) != 0 && (*pte & PTE_P)){
+    // Another thread mapped it first; retry the access.
+    release(&faultlock);
+    return 0;
+  }
+  if(!write){
+    if(mappages(pgdir, (char*)va, PGSIZE, V2P(zeropage), PTE_U|PTE_COW) < 0){
+      release(&faultlock);
+      return -1;
+    }
+    release(&faultlock);
+    return 1;
+  }
+  if((mem = kalloc()) == 0){
+    release(&faultlock);
+    return -1;
+  }
+  memset(mem, 0, PGSIZE);
+  if(mappages(pgdir, (char*)va, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
+    release(&faultlock);
+    kfree(mem);
+    return -1;
+  }
+  release(&faultlock);
+  return 1;
+}
+
+// The kernel is about to touch the n bytes at user address va
+// through pgdir directly (argptr(), fetchint(), fetchstr()).
+// Map reserved heap and, for a write, break copy-on-write
+// sharing now, so that running out of memory fails the system
+// call instead of faulting in the kernel.  Returns -1 on failure.
+int
+uvmprepare(pde_t *pgdir, uint va, uint n, uint sz, int write)
+{
+  pte_t *pte;
+  uint a, last;
+
+  if(n == 0)
+    return 0;
+  last = PGROUNDDOWN(va + n - 1);
+  for(a = PGROUNDDOWN(va); ; a += PGSIZE){
+    pte = walkpgdir(pgdir, (char*)a, 0);
+    if((pte == 0 || !(*pte & PTE_P)) && lazyfault(pgdir, a, sz, write) < 0)
+      return -1;
+    pte = walkpgdir(pgdir, (char*)a, 0);
+    if(write && pte && (*pte & PTE_COW) && cowfault(pgdir, a) < 0)
+      return -1;
+    if(a == last)
+      break;
+  }
+  return 0;
+}
+
+// Physical address of user address va in pgdir, after faulting
+// it in and out of copy-on-write sharing so that it stays put.
+// Returns 0 if va is not accessible user memory.
+uint
+uvaphys(pde_t *pgdir, uint va, uint sz)
+{
+  pte_t *pte;
+
+  pte = walkpgdir(pgdir, (char*)va, 0);
+  if((pte == 0 || !(*pte & PTE_P)) && lazyfault(pgdir, va, sz, 1) < 0)
+    return 0;
+  if((pte = walkpgdir(pgdir, (char*)va, 0)) == 0)
+    return 0;
+  if((*pte & PTE_COW) && cowfault(pgdir, va) < 0)
+    return 0;
+  if((*pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+    return 0;
+  return PTE_ADDR(*pte) | (va & (PGSIZE-1));
+}
+
 //PAGEBREAK!
 // Map user virtual address to kernel address.
 char*
@@ -356,7 +618,7 @@ uva2ka(pde_t *pgdir, char *uva)
   pte_t *pte;
 
   pte = walkpgdir(pgdir, uva, 0);
-  if((*pte & PTE_P) == 0)
+  if(pte == 0 || (*pte & PTE_P) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
@@ -371,10 +633,24 @@ copyout(pde_t *pgdir, uint va, void *p, uint len)
 {
   char *buf, *pa0;
   uint n, va0;
+  pte_t *pte;
+  struct proc *curproc;
 
   buf = (char*)p;
+  curproc = myproc();
   while(len > 0){
     va0 = (uint)PGROUNDDOWN(va);
+    // Writes through the kernel mapping do not fault, so
+    // map reserved heap (lazyfault()) and break copy-on-write
+    // sharing here.
+    pte = walkpgdir(pgdir, (char*)va0, 0);
+    if((pte == 0 || !(*pte & PTE_P)) && curproc && curproc->pgdir == pgdir){
+      if(lazyfault(pgdir, va0, curproc->sz, 1) < 0)
+        return -1;
+      pte = walkpgdir(pgdir, (char*)va0, 0);
+    }
+    if(pte && (*pte & PTE_COW) && cowfault(pgdir, va0) < 0)
+      return -1;
     pa0 = uva2ka(pgdir, (char*)va0);
     if(pa0 == 0)
       return -1;
@@ -117,6 +117,27 @@ sti(void)
   asm volatile("sti");
 }
 
+// Low 32 bits of the time-stamp counter.  The difference
+// of two readings is right while they are less than 2^32
+// cycles apart.
+static inline uint
+rdtsc(void)
+{
+  uint lo, hi;
+
+  asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+  return lo;
+}
+
+// Enable interrupts and wait for one.  sti only takes
+// effect after the following instruction, so an interrupt
+// that is already pending cannot slip in before the hlt.
+static inline void
+stihlt(void)
+{
+  asm volatile("sti; hlt");
+}
+
 static inline uint
 xchg(volatile uint *addr, uint newval)
 {
@@ -138,6 +159,14 @@ rcr2(void)
   return val;
 }
 
+static inline uint
+rcr3(void)
+{
+  uint val;
+  asm volatile("movl %%cr3,%0" : "=r" (val));
+  return val;
+}
+
 static inline void
 lcr3(uint val)
 {